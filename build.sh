@@ -7,4 +7,16 @@ else
     LINK="-lutil"
 fi
 
+# ./build.sh test [update] replays test/captures against test/golden; ./build.sh bench times them.
+# Neither needs yed: the driver builds against the stub API in test/.
+if [[ "$1" == "test" || "$1" == "bench" ]]; then
+    g++ -o test/replay test/replay.cpp test/stub.cpp -O2 -std=c++11 -Itest ${WARN} ${LINK} -lpthread || exit 1
+
+    if [[ "$1" == "bench" ]]; then
+        exec test/replay bench "${@:2}" test/captures/*.cap
+    fi
+
+    exec test/run.sh "${@:2}"
+fi
+
 g++ -o terminal.so terminal.cpp -std=c++11 ${WARN} ${LINK} $(yed --print-cppflags --print-ldflags)
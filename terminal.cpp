@@ -1,33 +1,55 @@
 #include <memory>
+#include <algorithm>
 #include <vector>
-#include <deque>
 #include <list>
+#include <deque>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <unistd.h>
 #include <signal.h>
-#include <poll.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <spawn.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <climits>
+#include <cstdarg>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #ifdef __APPLE__
 #include <util.h>
+#include <sys/event.h>
 #else
 #include <pty.h>
 #include <utmp.h>
+#include <sys/epoll.h>
 #endif
 
 extern "C" {
 #include <yed/plugin.h>
 }
 
+/* posix_spawn() is only used where it can give the child a session of its own. */
+#if defined(POSIX_SPAWN_SETSID) && !defined(__APPLE__)
+#define USE_POSIX_SPAWN
+#endif
+
+extern char **environ;
+
 
 
 template<typename F>
@@ -81,10 +103,37 @@ do {                                                               \
     LOG_EXIT();                                                    \
 } while (0)
 
+/*
+ * Terminal output is parsed on each terminal's reader thread, which must not call
+ * into yed. There, DBG() messages go to the terminal's Log_Queue (under its model
+ * lock) and the main thread logs them on its next update.
+ */
+struct Log_Queue {
+    int                      on = 0;
+    std::vector<std::string> lines;
+};
+
+static thread_local Log_Queue *thread_log_queue = NULL;
+
+static void queue_log(const char *fmt, ...) {
+    va_list args;
+    char    buff[1024];
+
+    va_start(args, fmt);
+    vsnprintf(buff, sizeof(buff), fmt, args);
+    va_end(args);
+
+    thread_log_queue->lines.push_back(buff);
+}
+
 #ifdef DBG_LOG_ON
 #define DBG(...)                                                   \
 do {                                                               \
-    if (yed_var_is_truthy("terminal-debug-log")) {                 \
+    if (thread_log_queue != NULL) {                                \
+        if (thread_log_queue->on) {                                \
+            queue_log(__FILE__ ":" LOG_XSTR(__LINE__) ": " __VA_ARGS__); \
+        }                                                          \
+    } else if (yed_var_is_truthy("terminal-debug-log")) {          \
         LOG_FN_ENTER();                                            \
         yed_log(__FILE__ ":" LOG_XSTR(__LINE__) ": " __VA_ARGS__); \
         LOG_EXIT();                                                \
@@ -104,8 +153,17 @@ do {                                                               \
 #define DEFAULT_SHELL            "/bin/bash"
 #define DEFAULT_TERMVAR          "xterm-256color"
 #define DEFAULT_SCROLLBACK       10000
+#define DEFAULT_HOT_SCROLLBACK   1000
 #define DEFAULT_MAX_BLOCK_SIZE   16384
 #define DEFAULT_READ_CHUNK_SIZE  1024
+#define DEFAULT_MAX_FPS          60
+#define DEFAULT_HIGH_WATER_MARK  4194304
+#define MAX_READ_SIZE            (256 * 1024)
+#define MAX_WRITE_SIZE           (64 * 1024)
+#define STATS_VAR_INTERVAL_MS    (1000)
+#define SYNC_TIMEOUT_MS          (150)
+#define FAST_FORWARD_IDLE_MS     (50)
+#define FAST_FORWARD_MAX_MS      (1000)
 
 const char *get_shell() {
     const char *shell;
@@ -138,6 +196,16 @@ int get_scrollback() {
     return scrollback;
 }
 
+int get_hot_scrollback() {
+    int hot;
+
+    if (!yed_get_var_as_int("terminal-hot-scrollback", &hot)) {
+        hot = DEFAULT_HOT_SCROLLBACK;
+    }
+
+    return hot;
+}
+
 int get_max_block_size() {
     int max;
 
@@ -158,614 +226,2618 @@ int get_read_chunk_size() {
     return size;
 }
 
-#define N_COLORS (18)
-static yed_attrs colors[N_COLORS];
+int get_max_fps() {
+    int fps;
 
-#define CDEFAULT          (N_COLORS - 2)
-#define CDEFAULT_INACTIVE (N_COLORS - 1)
+    if (!yed_get_var_as_int("terminal-max-fps", &fps)) {
+        fps = DEFAULT_MAX_FPS;
+    }
 
-#define MODE_RESET ('!')
-#define MODE_PRIV  ('?')
-#define MODE_XTERM ('>')
+    return fps;
+}
 
-struct CSI {
-    std::vector<long> args;
-    int               command  = 0;
-    int               len      = 0;
-    int               complete = 0;
-    int               mode     = 0;
+int get_high_water_mark() {
+    int mark;
 
-    CSI(const char *str) {
-        char c;
+    if (!yed_get_var_as_int("terminal-high-water-mark", &mark)) {
+        mark = DEFAULT_HIGH_WATER_MARK;
+    }
 
-        c = *str;
+    return mark;
+}
 
-        if (!c) { return; }
+/*
+ * Returns the length of the run of printable ASCII (0x20 - 0x7E) at the start of s.
+ * Anything else (ESC, other C0 controls, DEL, UTF-8) ends the run.
+ */
+static size_t scan_printable(const char *s, size_t len) {
+    size_t i = 0;
 
-        this->len = 1;
+#if defined(__SSE2__)
+    const __m128i lo  = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
 
-#define NEXT()            \
-do {                      \
-    str += 1;             \
-    c = *str;             \
-    if (!c) { goto out; } \
-    this->len += 1;       \
-} while (0)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        /* Signed compare, so bytes >= 0x80 fail along with controls. */
+        __m128i ok   = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, lo));
+        unsigned mask = _mm_movemask_epi8(ok);
 
-#define IS_DELIM(_c) ((_c) == ';' || (_c) == ':' || (_c) == '?' || (_c) == ' ' || (_c) == '>' || (c) == '!' || (c) == '%')
-#define IS_FINAL(_c) ((_c) >= 0x40 && (_c) <= 0x7E)
+        if (mask != 0xFFFF) { return i + __builtin_ctz(~mask); }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t lo  = vdupq_n_u8(0x20);
+    const uint8x16_t del = vdupq_n_u8(0x7F);
 
-        while (IS_DELIM(c)) {
-            switch (c) {
-                case '!': this->mode = MODE_RESET; break;
-                case '?': this->mode = MODE_PRIV;  break;
-                case '>': this->mode = MODE_XTERM; break;
-                case ';': this->args.push_back(0); break;
-            }
-            NEXT();
-        }
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v  = vld1q_u8((const uint8_t*)(s + i));
+        uint8x16_t ok = vandq_u8(vcgeq_u8(v, lo), vcltq_u8(v, del));
+        /* Narrow to 4 bits per byte so the result fits in one 64-bit lane. */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(ok), 4)), 0);
 
-        while (!IS_FINAL(c) && c != '\e') {
-            std::string sarg;
-            long        arg;
+        if (mask != ~0ULL) { return i + (__builtin_ctzll(~mask) >> 2); }
+    }
+#endif
 
-            if (!is_digit(c) && !IS_DELIM(c)) { goto out; }
+    for (; i < len; i += 1) {
+        unsigned char c = s[i];
+        if (c < 0x20 || c >= 0x7F) { break; }
+    }
 
-            while (is_digit(c)) {
-                sarg += c;
-                NEXT();
-            }
+    return i;
+}
 
-            sscanf(sarg.c_str(), "%ld", &arg);
-            this->args.push_back(arg);
+/*
+ * Terminals outlive a reload of the plugin as a snapshot: a flat byte string that
+ * the newly loaded code reads back in. Anything trivially copyable is written as
+ * its bytes, so SNAPSHOT_VERSION has to change whenever what is written, or the
+ * layout of one of those types, does. A short read sets bad rather than overrunning.
+ */
+#define SNAPSHOT_VAR_NAME "__term_snapshot_addr"
+#define SNAPSHOT_MAGIC    (0x6d727479u)
+#define SNAPSHOT_VERSION  (4)
+
+struct Snapshot {
+    std::string bytes;
+    size_t      off = 0;
+    int         bad = 0;
+
+    template <typename T>
+    void put(const T &val) { this->bytes.append((const char*)&val, sizeof(T)); }
+
+    void put(const std::string &str) {
+        this->put((u64)str.size());
+        this->bytes.append(str);
+    }
+
+    template <typename T>
+    void put(const std::vector<T> &vec) {
+        this->put((u64)vec.size());
+        this->bytes.append((const char*)vec.data(), vec.size() * sizeof(T));
+    }
+
+    size_t left() const { return this->bad ? 0 : this->bytes.size() - this->off; }
 
-            while (IS_DELIM(c)) { NEXT(); }
+    template <typename T>
+    void get(T &val) {
+        if (this->left() < sizeof(T)) {
+            this->bad = 1;
+            memset((void*)&val, 0, sizeof(T));
+            return;
         }
 
-        if (c == '\e') {
-            this->len -= 1;
-            goto out;
+        memcpy((void*)&val, this->bytes.data() + this->off, sizeof(T));
+        this->off += sizeof(T);
+    }
+
+    void get(std::string &str) {
+        u64 n;
+
+        this->get(n);
+        if (this->left() < n) {
+            this->bad = 1;
+            return;
         }
 
-        this->command  = c;
-        this->complete = 1;
-out:;
+        str.assign(this->bytes.data() + this->off, n);
+        this->off += n;
+    }
+
+    template <typename T>
+    void get(std::vector<T> &vec) {
+        u64 n;
 
-#undef IS_DELIM
-#undef NEXT
+        this->get(n);
+        if (this->left() / sizeof(T) < n) {
+            this->bad = 1;
+            return;
+        }
+
+        vec.resize(n);
+        memcpy((void*)vec.data(), this->bytes.data() + this->off, n * sizeof(T));
+        this->off += n * sizeof(T);
     }
 };
 
-struct OSC {
-    long        command  = 0;
-    int         len      = 0;
-    std::string arg;
-    int         complete = 0;
+#define N_COLORS (18)
+static yed_attrs colors[N_COLORS];
+static u32       colors_gen;
+
+#define CDEFAULT          (N_COLORS - 2)
+#define CDEFAULT_INACTIVE (N_COLORS - 1)
+
+#define MODE_RESET ('!')
+#define MODE_PRIV  ('?')
+#define MODE_XTERM ('>')
+
+#define CSI_MAX_ARG  (99999)
+#define CSI_MAX_ARGS (30)
+
+/*
+ * Parameters are accumulated in place as the sequence is scanned.
+ * Arguments past CSI_MAX_ARGS are dropped, as in xterm.
+ * A parameter that followed a ':' is a sub-parameter of the one before it
+ * and has its bit set in sub.
+ */
+struct CSI {
+    long args[CSI_MAX_ARGS];
+    u32  sub          = 0;
+    int  n_args       = 0;
+    int  command      = 0;
+    int  mode         = 0;
+    int  intermediate = 0;
+    long arg          = 0;
+    int  in_args      = 0;
+    int  sub_next     = 0;
+
+    void clear() {
+        this->sub          = 0;
+        this->n_args       = 0;
+        this->command      = 0;
+        this->mode         = 0;
+        this->intermediate = 0;
+        this->arg          = 0;
+        this->in_args      = 0;
+        this->sub_next     = 0;
+    }
+
+    void digit(char c) {
+        if (this->arg < CSI_MAX_ARG) {
+            this->arg = 10 * this->arg + (c - '0');
+        }
+        this->in_args = 1;
+    }
 
-    OSC(const char *str) {
-        char c;
+    void push_arg() {
+        if (this->n_args < CSI_MAX_ARGS) {
+            if (this->sub_next) { this->sub |= 1u << this->n_args; }
+            this->args[this->n_args] = this->arg;
+            this->n_args += 1;
+        }
+        this->arg = 0;
+    }
 
-        c = *str;
+    void next_arg(char delim) {
+        this->push_arg();
+        this->sub_next = delim == ':';
+        this->in_args  = 1;
+    }
 
-        if (!c) { return; }
+    void finish(char c) {
+        if (this->in_args) { this->push_arg(); }
+        this->command = c;
+    }
 
-        this->len = 1;
+    long get(int i, long def = 0) const { return i < this->n_args ? this->args[i] : def; }
+    int  is_sub(int i)            const { return i < this->n_args && (this->sub & (1u << i)); }
 
-#define NEXT()            \
-do {                      \
-    str += 1;             \
-    c = *str;             \
-    if (!c) { goto out; } \
-    this->len += 1;       \
-} while (0)
+    int n_sub(int i) const {
+        int n = 0;
+        while (this->is_sub(i + n)) { n += 1; }
+        return n;
+    }
 
-        std::string scmd;
-        while (is_digit(c)) {
-            scmd += c;
-            NEXT();
+    /*
+     * Reads the color that follows an SGR 38 or 48 at args[i], in either the
+     * ';' form (38;5;n, 38;2;r;g;b) or the ':' form (38:5:n, 38:2:r:g:b, 38:2:cs:r:g:b).
+     * Advances i past everything that belongs to it.
+     */
+    int extended_color(int &i, int *kind, u32 *color) const {
+        int  sub   = this->is_sub(i);
+        int  n     = this->n_sub(i);
+        long which = this->get(i);
+        int  ok    = 1;
+
+        i += 1;
+
+        switch (which) {
+            case 2:
+                /* Skip the colorspace ID. */
+                if (sub && n >= 5) { i += 1; }
+                *kind  = ATTR_KIND_RGB;
+                *color = RGB_32(this->get(i), this->get(i + 1), this->get(i + 2));
+                i += 3;
+                break;
+            case 5:
+                *kind  = ATTR_KIND_256;
+                *color = this->get(i);
+                i += 1;
+                break;
+            default:
+                ok = 0;
+                break;
+        }
+
+        if (sub) {
+            while (this->is_sub(i)) { i += 1; }
         }
 
-        sscanf(scmd.c_str(), "%ld", &this->command);
+        return ok;
+    }
 
-        if (c != ';' && c != CTRL_G) { goto out; }
+    std::string str() const {
+        std::string s;
 
-        while (c && c != CTRL_G && c != '\e') {
-            if (c == '\e') {
-                NEXT();
-                if (c == '\\') { break; }
-            }
-            this->arg += c;
-            NEXT();
+        if (this->mode) { s += (char)this->mode; }
+        for (int i = 0; i < this->n_args; i += 1) {
+            if (i) { s += this->is_sub(i) ? ':' : ';'; }
+            s += std::to_string(this->args[i]);
         }
+        if (this->intermediate) { s += (char)this->intermediate; }
+        s += (char)this->command;
 
-        if (c == '\e') {
-            NEXT();
-            if (c == '\\') {
-                this->complete = 1;
-            } else {
-                this->len -= 1;
+        return s;
+    }
+};
+
+struct OSC {
+    long        command  = 0;
+    int         in_arg   = 0;
+    std::string arg;
+
+    void clear() {
+        this->command = 0;
+        this->in_arg  = 0;
+        this->arg.clear();
+    }
+
+    void put(char c) {
+        if (this->in_arg) {
+            this->arg += c;
+        } else if (is_digit(c)) {
+            if (this->command < CSI_MAX_ARG) {
+                this->command = 10 * this->command + (c - '0');
             }
         } else {
-            this->complete = 1;
+            this->in_arg = 1;
+            if (c != ';') { this->arg += c; }
         }
-out:;
-
-#undef NEXT
     }
 };
 
 struct DCS {
-    int         len      = 0;
-    int         complete = 0;
     std::string str;
 
-    DCS(const char *str) {
-        char c;
+    void clear()      { this->str.clear(); }
+    void put(char c)  { this->str += c;    }
+};
 
-        c = *str;
+/*
+ * Byte-level state machine for the VT output stream.
+ * It keeps its state between reads so that a sequence split across two
+ * chunks resumes where it left off instead of being reassembled and rescanned.
+ * The actions themselves live in Term::feed().
+ */
+enum {
+    PARSE_GROUND,
+    PARSE_UTF8,
+    PARSE_ESC,
+    PARSE_ESC_INTER,
+    PARSE_CSI,
+    PARSE_CSI_INTER,
+    PARSE_CSI_IGNORE,
+    PARSE_OSC,
+    PARSE_OSC_ESC,
+    PARSE_DCS,
+    PARSE_DCS_ESC,
+};
 
-        if (!c) { return; }
+struct Parser {
+    int         state      = PARSE_GROUND;
+    int         esc_inter  = 0;
+    yed_glyph   utf8;
+    int         utf8_len   = 0;
+    int         utf8_need  = 0;
+    CSI         csi;
+    OSC         osc;
+    DCS         dcs;
+    int         do_log     = 0;
+    std::string debug;
+
+    Parser() { this->utf8.data = 0; }
+
+    void start_utf8(unsigned char c) {
+        this->utf8.data     = 0;
+        this->utf8.bytes[0] = c;
+        this->utf8_len      = 1;
+        this->utf8_need     = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+        this->state         = PARSE_UTF8;
+    }
 
-        this->len = 1;
+    /* Returns 1 when the glyph in this->utf8 is complete. */
+    int add_utf8(unsigned char c) {
+        this->utf8.bytes[this->utf8_len] = c;
+        this->utf8_len += 1;
+        return this->utf8_len == this->utf8_need;
+    }
 
-#define NEXT()            \
-do {                      \
-    str += 1;             \
-    c = *str;             \
-    if (!c) { goto out; } \
-    this->len += 1;       \
-} while (0)
+    /* A sequence that was cut off by the reload picks up where it left off. */
+    void save(Snapshot &snap) const {
+        snap.put(this->state);
+        snap.put(this->esc_inter);
+        snap.put(this->utf8);
+        snap.put(this->utf8_len);
+        snap.put(this->utf8_need);
+        snap.put(this->csi);
+        snap.put(this->osc.command);
+        snap.put(this->osc.in_arg);
+        snap.put(this->osc.arg);
+        snap.put(this->dcs.str);
+    }
 
-        while (c) {
-            if (c == '\e') {
-                NEXT();
-                if (c == '\\') {
-                    this->complete = 1;
-                    break;
-                }
-                this->len -= 1;
-                break;;
-            }
-            this->str += c;
-            NEXT();
+    void load(Snapshot &snap) {
+        snap.get(this->state);
+        snap.get(this->esc_inter);
+        snap.get(this->utf8);
+        snap.get(this->utf8_len);
+        snap.get(this->utf8_need);
+        snap.get(this->csi);
+        snap.get(this->osc.command);
+        snap.get(this->osc.in_arg);
+        snap.get(this->osc.arg);
+        snap.get(this->dcs.str);
+
+        if (this->utf8_len < 0 || this->utf8_len >= 4 || this->csi.n_args > CSI_MAX_ARGS) { snap.bad = 1; }
+        if (this->state == PARSE_UTF8 && (this->utf8_need < 2 || this->utf8_need > 4 || this->utf8_len >= this->utf8_need)) {
+            snap.bad = 1;
         }
-out:;
-
-#undef NEXT
     }
 };
 
+/* attr is an index into the owning Screen's palette. 0 is always ZERO_ATTR. */
 struct Cell {
     yed_glyph glyph;
-    yed_attrs attrs;
+    u16       attr;
 };
 
-struct Line : std::vector<Cell> {
-    int dirty = 0;
-
-    void clear_cells(int width, yed_attrs attrs) {
-        int prev_width = this->size();
-
-        for (int i = 0; i < prev_width; i += 1) {
-            (*this)[i] = { yed_glyph_copy(GLYPH("")), attrs };
-        }
+static inline int attrs_equal(const yed_attrs &a, const yed_attrs &b) {
+    return a.flags == b.flags && a.fg == b.fg && a.bg == b.bg;
+}
 
-        this->resize(width, { yed_glyph_copy(GLYPH("")), attrs });
+/* Maps the 16 standard colors through terminal-color#. */
+static yed_attrs resolve_colors(yed_attrs attrs) {
+    if (ATTR_FG_KIND(attrs.flags) == ATTR_KIND_16 && attrs.fg >= 30 && attrs.fg <= 37) {
+        int fg = attrs.fg - 30 + (!!(attrs.flags & ATTR_16_LIGHT_FG)) * 8;
+        ATTR_SET_FG_KIND(attrs.flags, ATTR_FG_KIND(colors[fg].flags));
+        attrs.fg = colors[fg].fg;
     }
 
-    Line * new_by_donation(int width, yed_attrs attrs) {
-        Line *l = new Line(0, ZERO_ATTR);
+    if (ATTR_BG_KIND(attrs.flags) == ATTR_KIND_16 && attrs.bg >= 30 && attrs.bg <= 37) {
+        int bg = attrs.bg - 30 + (!!(attrs.flags & ATTR_16_LIGHT_BG)) * 8;
+        ATTR_SET_BG_KIND(attrs.flags, ATTR_FG_KIND(colors[bg].flags));
+        attrs.bg = colors[bg].fg;
+    }
 
-        *l = std::move(*this);
-        l->clear_cells(width, attrs);
+    return attrs;
+}
 
-        return l;
+struct Attrs_Hash {
+    size_t operator()(const yed_attrs &a) const {
+        return (a.flags * 0x9E3779B1u) ^ (a.fg * 0x85EBCA77u) ^ (a.bg * 0xC2B2AE3Du);
     }
+};
+
+struct Attrs_Equal {
+    bool operator()(const yed_attrs &a, const yed_attrs &b) const { return attrs_equal(a, b); }
+};
 
-    Line(int width, yed_attrs attrs) {
-        this->clear_cells(width, attrs);
+typedef std::unordered_map<yed_attrs, u16, Attrs_Hash, Attrs_Equal> Palette_Map;
+
+#define MAX_PALETTE (65536)
+
+/*
+ * A row of the screen. The cells live in the owning Screen's slab; a Line only
+ * points at its stride of it, so rows can be reordered without moving cells.
+ * Cells [dirty_l, dirty_r) have changed since the row was last written to the buffer.
+ * wrapped is set when the row's text ran on into the next row by autowrap rather
+ * than ending there, so consecutive wrapped rows and the row after them form one
+ * logical line.
+ */
+struct Line {
+    Cell *cells   = NULL;
+    int   len     = 0;
+    int   dirty_l = 0;
+    int   dirty_r = 0;
+    int   pos     = 0;
+    int   wrapped = 0;
+
+    Cell&       operator[](std::size_t idx)       { return this->cells[idx]; }
+    const Cell& operator[](std::size_t idx) const { return this->cells[idx]; }
+
+    int size() const { return this->len; }
+
+    int is_dirty() const { return this->dirty_r > this->dirty_l; }
+
+    /* An all-zero Cell is an empty glyph with ZERO_ATTR, so only a colored clear touches cells one at a time. */
+    void clear_cells(int width, u16 attr) {
+        this->wrapped = 0;
+        memset(this->cells, 0, this->len * sizeof(Cell));
+
+        if (attr != 0) {
+            for (int i = 0; i < MIN(width, this->len); i += 1) {
+                this->cells[i].attr = attr;
+            }
+        }
     }
 };
 
+#define STRIDE_ALIGN            (32)
 #define DEFAULT_WIDTH           (80)
 #define DEFAULT_HEIGHT          (24)
 
-struct Screen {
-    std::deque<Line*>  lines;
-    int                width           = 0;
-    int                height          = 0;
-    int                cursor_row      = 1;
-    int                cursor_col      = 1;
-    int                cursor_row_save = 1;
-    int                cursor_col_save = 1;
-    yed_attrs          attrs_save      = ZERO_ATTR;
-    int                cursor_saved    = 0;
-    int                scroll_t        = 0;
-    int                scroll_b        = 0;
-    int                scrollback      = get_scrollback();
-    yed_attrs         &attrs;
+/*
+ * A row move made to the model that hasn't reached the yed buffer yet: count times over,
+ * delete buffer row del_row and then insert an empty row at new_row.
+ */
+struct Row_Op {
+    int del_row;
+    int new_row;
+    int count;
+};
 
-    Screen(yed_attrs &_attrs) : attrs(_attrs) { }
+/* With term mode off, batches of row moves longer than this rewrite the rows instead of shifting the buffer. */
+#define MAX_SHIFTED_ROWS        (4)
+
+/* Dirty spans that need fewer glyph edits than this are patched into the buffer line in place. */
+#define MAX_PATCH_GLYPHS        (8)
+
+/*
+ * Scrollback lines older than the uncompressed depth are kept here as
+ * blocks of plain text plus attribute runs. A line is decoded only when it
+ * is drawn or has to be written to the buffer. Each block also has a filter
+ * of the trigrams in its text, which lets term-search skip most blocks.
+ * The tier always holds cap lines; the ones that were never written are
+ * counted by blank and sit at the top.
+ * Whether the buffer row of each line shows it yet is kept apart from the
+ * blocks, in flushed: a ring of cap stamps that turns with the lines. A line
+ * is up to date when its stamp is flush_gen, so making every line stale is
+ * just a new flush_gen.
+ */
+struct Attr_Run {
+    u16       col;
+    u16       len;
+    yed_attrs attrs;
+};
 
-    ~Screen() {
-        for (auto linep : this->lines) { delete linep; }
-    }
+#define COLD_BLOCK_LINES (256)
+#define COLD_GRAM_BITS   (4096)
 
-    Line& operator[](std::size_t idx)             { return *(lines[idx]); }
-    const Line& operator[](std::size_t idx) const { return *(lines[idx]); }
+static inline u32 gram_bit(const char *p) {
+    u32 gram = ((u32)(u8)p[0] << 16) | ((u32)(u8)p[1] << 8) | (u32)(u8)p[2];
+    return (gram * 2654435761u) >> 20;
+}
 
-    void set_cursor(int row, int col) {
-        this->cursor_row = row; LIMIT(this->cursor_row, 1, this->height);
-        this->cursor_col = col; LIMIT(this->cursor_col, 1, this->width);
+struct Cold_Block {
+    std::string            text;
+    std::vector<Attr_Run>  runs;
+    std::vector<u32>       text_offs;
+    std::vector<u32>       run_offs;
+    std::vector<u8>        wrapped;
+    u64                    grams[COLD_GRAM_BITS / 64];
+    std::vector<yed_attrs> resolved;
+    u32                    resolved_gen = 0;
+
+    Cold_Block() {
+        this->text_offs.push_back(0);
+        this->run_offs.push_back(0);
+        memset(this->grams, 0, sizeof(this->grams));
     }
 
-    void move_cursor(int rows, int cols) {
-        this->set_cursor(this->cursor_row + rows, this->cursor_col + cols);
-    }
+    int n_lines() const { return this->text_offs.size() - 1; }
 
-    void save_cursor() {
-        this->cursor_row_save = this->cursor_row;
-        this->cursor_col_save = this->cursor_col;
-        this->attrs_save      = this->attrs;
-        this->cursor_saved    = 1;
+    /* Adds the trigrams of text that start at or after from to the filter. */
+    void index(size_t from) {
+        for (size_t i = from; i + 3 <= this->text.size(); i += 1) {
+            u32 bit = gram_bit(&this->text[i]);
+            this->grams[bit / 64] |= (u64)1 << (bit % 64);
+        }
     }
 
-    void restore_cursor() {
-        this->cursor_row   = this->cursor_row_save;
-        this->cursor_col   = this->cursor_col_save;
-        this->attrs        = this->attrs_save;
-        this->cursor_saved = 0;
+    /* 0 when pat can't be in text. Patterns shorter than a trigram always might be. */
+    int may_contain(const std::string &pat) const {
+        for (size_t i = 0; i + 3 <= pat.size(); i += 1) {
+            u32 bit = gram_bit(&pat[i]);
+            if (!(this->grams[bit / 64] & ((u64)1 << (bit % 64)))) { return 0; }
+        }
+        return 1;
     }
+};
 
-    void make_dirty() {
-        for (auto linep : this->lines) { linep->dirty = 1; }
-    }
+struct Cold_Line {
+    const char     *text    = "";
+    int             len     = 0;
+    const Attr_Run *runs    = NULL;
+    int             n_runs  = 0;
+    int             wrapped = 0;
+};
 
-    void _delete_line(int which) {
-        delete this->lines[which];
-        this->lines.erase(this->lines.begin() + which);
+struct Cold_Scrollback {
+    std::deque<Cold_Block> blocks;
+    std::vector<u32>       flushed;
+    int                    cap         = 0;
+    int                    blank       = 0;
+    int                    first       = 0;
+    int                    flushed_top = 0;
+    u32                    flush_gen   = 1;
+
+    void set_cap(int cap) {
+        this->blocks.clear();
+        this->flushed.assign(cap, 0);
+        this->cap         = cap;
+        this->blank       = cap;
+        this->first       = 0;
+        this->flushed_top = 0;
+        this->flush_gen   = 1;
     }
 
-    void set_scroll(int top, int bottom) {
-        this->scroll_t = top;    LIMIT(this->scroll_t, 0, this->height);
-        this->scroll_b = bottom; LIMIT(this->scroll_b, 0, this->height);
-    }
+    u32& stamp(int idx) { return this->flushed[(this->flushed_top + idx) % this->cap]; }
 
-    int sctop()    { return this->scroll_t ? this->scroll_t : 1;            }
-    int scbottom() { return this->scroll_b ? this->scroll_b : this->height; }
+    int  is_stale(int idx)     { return this->stamp(idx) != this->flush_gen; }
+    void set_flushed(int idx)  { this->stamp(idx) = this->flush_gen;         }
+    void make_stale()          { this->flush_gen += 1;                       }
 
-    void set(int row, int col, yed_glyph *g) {
-        if (row > this->height || col > this->width) { return; }
+    void drop_oldest() {
+        this->flushed_top = (this->flushed_top + 1) % this->cap;
 
-        auto &line = (*this)[this->scrollback + row - 1];
-        auto &cell = line[col - 1];
+        if (this->blank) {
+            this->blank -= 1;
+            return;
+        }
 
-        cell.glyph = yed_glyph_copy(g);
+        this->first += 1;
+        if (this->first == this->blocks.front().n_lines()) {
+            this->blocks.pop_front();
+            this->first = 0;
+        }
+    }
 
-        int width = yed_get_glyph_width(g);
-        for (int i = 0; i < width; i += 1) {
-            if (col + i > this->width) { break; }
-            auto &cell = line[col - 1 + i];
-            cell.attrs = this->attrs;
+    /*
+     * Appends the first len cells of a line as the newest cold line, dropping the oldest.
+     * flushed says whether the buffer row that the line moves to already shows it.
+     */
+    void push(const Line &line, int len, const std::vector<yed_attrs> &palette, int flushed) {
+        if (this->cap == 0) { return; }
+
+        this->drop_oldest();
+
+        if (this->blocks.empty() || this->blocks.back().n_lines() == COLD_BLOCK_LINES) {
+            this->blocks.emplace_back();
         }
 
-        line.dirty = 1;
-    }
+        auto   &block = this->blocks.back();
+        size_t  from  = block.text.size();
 
-    void set_current_cell(yed_glyph *g) {
-        this->set(this->cursor_row, this->cursor_col, g);
-    }
+        for (int i = 0; i < len; i += 1) {
+            const Cell &cell = line[i];
 
-    void insert(int row, int col, yed_glyph *g) {
-        Cell new_cell;
+            if (cell.glyph.c) {
+                block.text.append(cell.glyph.bytes, yed_get_glyph_len((yed_glyph*)&cell.glyph));
+            } else {
+                block.text += ' ';
+            }
 
-        new_cell.glyph = yed_glyph_copy(g);
-        new_cell.attrs = this->attrs;
+            if (cell.attr != 0) {
+                if (block.runs.size() > block.run_offs.back()
+                &&  block.runs.back().col + block.runs.back().len == i
+                &&  attrs_equal(block.runs.back().attrs, palette[cell.attr])) {
+
+                    block.runs.back().len += 1;
+                } else {
+                    block.runs.push_back({ (u16)i, 1, palette[cell.attr] });
+                }
+            }
+        }
+
+        block.text_offs.push_back(block.text.size());
+        block.run_offs.push_back(block.runs.size());
+        block.wrapped.push_back(line.wrapped);
+        block.index(from >= 2 ? from - 2 : 0);
 
-        auto &line = (*this)[this->scrollback + row - 1];
-        line.insert(line.begin() + col - 1, new_cell);
-        line.pop_back();
+        this->stamp(this->cap - 1) = flushed ? this->flush_gen : 0;
     }
 
-    void del_cell(int row, int col) {
-        auto &line = (*this)[this->scrollback + row - 1];
-        line.erase(line.begin() + col - 1);
-        line.push_back({ yed_glyph_copy(GLYPH("")), this->attrs });
-        line.dirty = 1;
+    /* Takes the newest line back out, leaving a blank one at the top. */
+    void pop_newest() {
+        auto &block = this->blocks.back();
+        int   last  = block.n_lines() - 1;
+
+        block.text.resize(block.text_offs[last]);
+        block.runs.resize(block.run_offs[last]);
+        block.text_offs.pop_back();
+        block.run_offs.pop_back();
+        block.wrapped.pop_back();
+        if (block.resolved.size() > block.runs.size()) { block.resolved.resize(block.runs.size()); }
+
+        if (block.n_lines() == (this->blocks.size() == 1 ? this->first : 0)) {
+            this->blocks.pop_back();
+            if (this->blocks.empty()) { this->first = 0; }
+        }
+
+        /* The buffer gets an empty row at the top to go with the new blank line. */
+        this->blank       += 1;
+        this->flushed_top  = (this->flushed_top + this->cap - 1) % this->cap;
+        this->set_flushed(0);
     }
 
-    void clear_row_abs(int row) {
-        auto &line = (*this)[row - 1];
-        line.clear_cells(this->width, this->attrs);
-        line.dirty = 1;
+    void save(Snapshot &snap) const {
+        snap.put(this->cap);
+        snap.put(this->blank);
+        snap.put(this->first);
+        snap.put(this->flushed);
+        snap.put(this->flushed_top);
+        snap.put(this->flush_gen);
+        snap.put((u64)this->blocks.size());
+
+        for (auto &block : this->blocks) {
+            snap.put(block.text);
+            snap.put(block.runs);
+            snap.put(block.text_offs);
+            snap.put(block.run_offs);
+            snap.put(block.wrapped);
+            snap.put(block.grams);
+        }
     }
 
-    void clear_row(int row) {
-        this->clear_row_abs(this->scrollback + row);
+    void load(Snapshot &snap) {
+        u64 n_blocks;
+        int n_lines = 0;
+
+        snap.get(this->cap);
+        snap.get(this->blank);
+        snap.get(this->first);
+        snap.get(this->flushed);
+        snap.get(this->flushed_top);
+        snap.get(this->flush_gen);
+        snap.get(n_blocks);
+
+        this->blocks.clear();
+        for (u64 i = 0; i < n_blocks && !snap.bad; i += 1) {
+            this->blocks.emplace_back();
+
+            auto &block = this->blocks.back();
+
+            snap.get(block.text);
+            snap.get(block.runs);
+            snap.get(block.text_offs);
+            snap.get(block.run_offs);
+            snap.get(block.wrapped);
+            snap.get(block.grams);
+
+            if (block.text_offs.empty()
+            ||  block.run_offs.size() != block.text_offs.size()
+            ||  block.wrapped.size() != block.text_offs.size() - 1
+            ||  block.text_offs.back() != block.text.size()
+            ||  block.run_offs.back() != block.runs.size()) {
+
+                snap.bad = 1;
+                break;
+            }
+
+            n_lines += block.n_lines();
+        }
+
+        if (this->blank < 0 || this->first < 0 || this->blank + n_lines - this->first != this->cap) { snap.bad = 1; }
+        if (this->flushed.size() != (size_t)this->cap || this->flushed_top < 0 || this->flushed_top >= MAX(this->cap, 1)) { snap.bad = 1; }
     }
 
-    void scroll_up(yed_buffer *buffer) {
-        int del_row = this->scroll_t ? this->scrollback + this->scroll_t : 1;
-        int new_row = this->scrollback + this->scbottom();
+    /* idx 0 is the oldest line. */
+    Cold_Line get(int idx) const {
+        Cold_Line l;
 
-        auto new_line = this->lines[del_row - 1]->new_by_donation(this->width, this->attrs);
-        this->_delete_line(del_row - 1);
+        if (idx < this->blank) { return l; }
 
-        if (new_row > this->lines.size()) {
-            this->lines.push_back(new_line);
-        } else {
-            this->lines.insert(this->lines.begin() + new_row - 1, new_line);
-        }
+        idx = idx - this->blank + this->first;
 
-        { BUFF_WRITABLE_GUARD(buffer);
-            yed_buff_delete_line_no_undo(buffer, del_row);
-            yed_buff_insert_line_no_undo(buffer, new_row);
-        }
+        auto &block = this->blocks[idx / COLD_BLOCK_LINES];
+        int   i     = idx % COLD_BLOCK_LINES;
 
-        for (int i = this->sctop(); i <= this->scbottom(); i += 1) {
-            auto &line = (*this)[this->scrollback + i - 1];
-            ASSERT(line.size() >= this->width, "bad line width");
-            line.dirty = 1;
-        }
+        l.text    = block.text.data() + block.text_offs[i];
+        l.len     = block.text_offs[i + 1] - block.text_offs[i];
+        l.runs    = block.runs.data() + block.run_offs[i];
+        l.n_runs  = block.run_offs[i + 1] - block.run_offs[i];
+        l.wrapped = block.wrapped[i];
 
-        ASSERT(this->lines.size() == this->scrollback + this->height, "rows mismatch");
+        return l;
     }
 
-    void scroll_down(yed_buffer *buffer) {
-        int del_row = this->scrollback + this->scbottom();
-        int new_row = this->scrollback + (this->scroll_t ? this->scroll_t : 1);
+    /*
+     * resolve_colors() of each of line idx's runs. A block resolves all of its
+     * runs at once and keeps them until the colors change, so a frame scrolled
+     * back into the tier doesn't redo it on every draw.
+     */
+    const yed_attrs *resolved_runs(int idx) {
+        if (idx < this->blank) { return NULL; }
 
-        this->_delete_line(del_row - 1);
-        this->lines.insert(this->lines.begin() + new_row - 1, new Line(this->width, this->attrs));
+        idx = idx - this->blank + this->first;
 
-        { BUFF_WRITABLE_GUARD(buffer);
-            yed_buff_delete_line_no_undo(buffer, del_row);
-            yed_buff_insert_line_no_undo(buffer, new_row);
+        auto &block = this->blocks[idx / COLD_BLOCK_LINES];
+
+        if (block.resolved_gen != colors_gen) {
+            block.resolved.clear();
+            block.resolved_gen = colors_gen;
         }
 
-        for (int i = this->sctop(); i <= this->scbottom(); i += 1) {
-            auto &line = (*this)[this->scrollback + i - 1];
-            ASSERT(line.size() >= this->width, "bad line width");
-            line.dirty = 1;
+        for (size_t i = block.resolved.size(); i < block.runs.size(); i += 1) {
+            block.resolved.push_back(resolve_colors(block.runs[i].attrs));
         }
 
-        ASSERT(this->lines.size() == this->scrollback + this->height, "rows mismatch");
+        return block.resolved.data() + block.run_offs[idx % COLD_BLOCK_LINES];
     }
+};
 
-    void insert_line(int row, yed_buffer *buffer) {
-        int del_row = this->scrollback + this->scbottom();
-        int new_row = this->scrollback + row;
-
-        this->_delete_line(del_row - 1);
-        if (new_row > this->lines.size()) {
-            this->lines.push_back(new Line(this->width, this->attrs));
-        } else {
-            this->lines.insert(this->lines.begin() + new_row - 1, new Line(this->width, this->attrs));
+/*
+ * Finds the last match of pat in block that starts on line skip or later and before
+ * buffer position (row, col), where block line 0 is buffer row base. A match may run
+ * on across wrapped lines, and from the last line into the first line of next.
+ * Returns 0 if there is none.
+ */
+static int search_block(const Cold_Block &block, int skip, int base, const Cold_Block *next,
+                        const std::string &pat, int row, int col, int *hit_row, int *hit_col) {
+    const std::string &text  = block.text;
+    int                n     = block.n_lines();
+    int                found = 0;
+    std::string        tail;
+    size_t             tail_at;
+
+    auto check = [&](size_t off) {
+        int line = std::upper_bound(block.text_offs.begin(), block.text_offs.end(), (u32)off)
+                 - block.text_offs.begin() - 1;
+        int r    = base + line;
+        int c    = 1;
+
+        if (line < skip || r > row) { return; }
+
+        for (int l = line; l < n && block.text_offs[l + 1] < off + pat.size(); l += 1) {
+            if (!block.wrapped[l]) { return; }
         }
 
-        { BUFF_WRITABLE_GUARD(buffer);
-            yed_buff_delete_line_no_undo(buffer, del_row);
-            yed_buff_insert_line_no_undo(buffer, new_row);
+        for (size_t i = block.text_offs[line]; i < off; i += 1) {
+            if ((text[i] & 0xC0) != 0x80) { c += 1; }
         }
 
-        for (int i = this->sctop(); i <= this->scbottom(); i += 1) {
-            auto &line = (*this)[this->scrollback + i - 1];
-            ASSERT(line.size() >= this->width, "bad line width");
-            line.dirty = 1;
+        if (r == row && c >= col) { return; }
+
+        if (!found || r > *hit_row || (r == *hit_row && c > *hit_col)) {
+            *hit_row = r;
+            *hit_col = c;
+            found    = 1;
         }
+    };
 
-        ASSERT(this->lines.size() == this->scrollback + this->height, "rows mismatch");
+    for (size_t off = text.find(pat); off != std::string::npos; off = text.find(pat, off + 1)) {
+        check(off);
     }
 
-    void delete_line(int row, yed_buffer *buffer) {
-        int del_row = this->scrollback + row;
-        int new_row = this->scrollback + this->scbottom();
-
-        this->_delete_line(del_row - 1);
-        this->lines.insert(this->lines.begin() + new_row - 1, new Line(this->width, this->attrs));
+    if (next != NULL && n > 0 && block.wrapped[n - 1] && next->n_lines() > 0 && pat.size() > 1) {
+        tail_at = text.size() - MIN(text.size(), pat.size() - 1);
+        tail    = text.substr(tail_at);
+        tail.append(next->text, 0, MIN((size_t)next->text_offs[1], pat.size() - 1));
 
-        { BUFF_WRITABLE_GUARD(buffer);
-            yed_buff_delete_line_no_undo(buffer, del_row);
-            yed_buff_insert_line_no_undo(buffer, new_row);
+        for (size_t off = tail.find(pat); off != std::string::npos; off = tail.find(pat, off + 1)) {
+            if (tail_at + off + pat.size() > text.size()) { check(tail_at + off); }
         }
+    }
 
-        if (this->scroll_t || this->scroll_b) {
-            for (int i = this->sctop(); i <= this->scbottom(); i += 1) {
-                auto &line = (*this)[this->scrollback + i - 1];
-                ASSERT(line.size() >= this->width, "bad line width");
-                line.dirty = 1;
-            }
-        }
+    return found;
+}
 
-        ASSERT(this->lines.size() == this->scrollback + this->height, "rows mismatch");
+/*
+ * The most recent hot lines of scrollback and the screen rows are kept in a ring
+ * of slots over one contiguous slab of cells (n_rows() * stride). Ring row i is slot
+ * ring[(head + i) % n_rows()], and slots[s].pos is the position of slot s in ring.
+ * Scrolling the whole screen only advances head; scroll regions rotate the slot
+ * indices inside the region. Slots with a dirty span are listed in dirty.
+ * The remaining scrollback - hot lines above the ring live in cold.
+ *
+ * Buffer row r is cold line r - 1 for r <= cold.cap and ring row r - 1 - cold.cap after that,
+ * with r counted from base(). The alternate screen keeps no history of its own: scrollback
+ * is still the number of buffer rows above its screen rows, but those are the main screen's.
+ * Rows here are counted as if the buffer held all of them; it really starts buffer_top rows
+ * further down, which only the calls into yed account for.
+ */
+struct Screen {
+    std::vector<Cell>       cells;
+    std::vector<Line>       slots;
+    std::vector<int>        ring;
+    std::vector<int>        spare;
+    std::vector<int>        dirty;
+    int                     head            = 0;
+    int                     stride          = 0;
+    int                     width           = 0;
+    int                     height          = 0;
+    int                     cursor_row      = 1;
+    int                     cursor_col      = 1;
+    int                     cursor_row_save = 1;
+    int                     cursor_col_save = 1;
+    yed_attrs               attrs_save      = ZERO_ATTR;
+    int                     cursor_saved    = 0;
+    int                     scroll_t        = 0;
+    int                     scroll_b        = 0;
+    int                     scrollback      = get_scrollback();
+    int                     hot             = MIN(get_hot_scrollback(), this->scrollback);
+    Cold_Scrollback         cold;
+    yed_attrs              &attrs;
+    std::vector<Row_Op>    &row_ops;
+    int                    &buffer_top;
+    std::vector<yed_attrs>  palette;
+    Palette_Map             palette_map;
+    size_t                  palette_grace   = 0;
+    std::vector<yed_attrs>  resolved;
+    u32                     resolved_gen    = 0;
+    yed_attrs               last_attrs      = ZERO_ATTR;
+    u16                     last_attr       = 0;
+    int                     reflows         = 0;
+
+    Screen(yed_attrs &_attrs, std::vector<Row_Op> &_row_ops, int &_buffer_top) : attrs(_attrs), row_ops(_row_ops), buffer_top(_buffer_top) {
+        LIMIT(this->hot, 0, this->scrollback);
+        this->cold.set_cap(this->scrollback - this->hot);
+
+        this->palette.push_back(ZERO_ATTR);
+        this->palette_map[ZERO_ATTR] = 0;
     }
 
-    void set_dimensions(int width, int height, yed_buffer *buffer) {
-        int max_width;
-        int num_lines;
+    /* Drops palette entries that no cell refers to anymore and renumbers the rest. */
+    void collect_palette() {
+        std::vector<int>       remap(this->palette.size(), -1);
+        std::vector<yed_attrs> palette;
+
+        remap[0] = 0;
+        palette.push_back(ZERO_ATTR);
 
-        max_width = width;
-        for (auto linep : this->lines) {
-            if (linep->size() > max_width) {
-                max_width = linep->size();
+        for (auto &cell : this->cells) {
+            if (remap[cell.attr] < 0) {
+                remap[cell.attr] = palette.size();
+                palette.push_back(this->palette[cell.attr]);
             }
+            cell.attr = remap[cell.attr];
         }
 
-        num_lines = height + this->scrollback;
+        this->palette.swap(palette);
+        this->resolved.clear();
+        this->palette_map.clear();
+        for (int i = 0; i < this->palette.size(); i += 1) {
+            this->palette_map[this->palette[i]] = i;
+        }
 
-        if (num_lines > this->lines.size()) {
-            while (this->lines.size() < num_lines) {
-                this->lines.push_back(new Line(max_width, this->attrs));
-            }
-        } else {
-            while (this->lines.size() > num_lines) {
-                auto linep = this->lines.back();
-                auto &line = *linep;
+        this->last_attrs = ZERO_ATTR;
+        this->last_attr  = 0;
+    }
 
-                if (line[0].glyph.c == 0) {
-                    this->_delete_line(this->lines.size() - 1);
-                } else {
-                    this->_delete_line(0);
-                }
+    u16 intern(const yed_attrs &attrs, int may_collect = 1) {
+        auto it = this->palette_map.find(attrs);
+        if (it != this->palette_map.end()) { return it->second; }
+
+        if (this->palette.size() == MAX_PALETTE) {
+            if (!may_collect) { return 0; }
+
+            /*
+             * When the screen really does hold this many colors, collecting again
+             * for every new one would rescan every cell per character. Wait until
+             * enough new colors have been asked for to pay for a scan.
+             */
+            if (this->palette_grace > 0) {
+                this->palette_grace -= 1;
+                return 0;
             }
-        }
 
-        if (max_width > this->width) {
-            for (auto linep : this->lines) {
-                auto &line = *linep;
+            this->collect_palette();
 
-                line.resize(max_width, { yed_glyph_copy(GLYPH("")), this->attrs });
+            if (this->palette.size() > MAX_PALETTE / 4 * 3) {
+                this->palette_grace = this->cells.size();
             }
+            if (this->palette.size() == MAX_PALETTE) { return 0; }
         }
 
-        this->width  = width;
-        this->height = height;
-
-        LIMIT(this->scroll_t, 0, this->height);
-        LIMIT(this->scroll_b, 0, this->height);
+        u16 idx = this->palette.size();
+        this->palette.push_back(attrs);
+        this->palette_map[attrs] = idx;
 
-        LIMIT(this->cursor_row, 1, this->height);
-        LIMIT(this->cursor_col, 1, this->width);
+        return idx;
+    }
 
-        for (int row = MAX(1, this->scrollback - this->height); row < this->scrollback + this->height; row += 1) {
-            auto &line = *(this->lines[row - 1]);
-            line.dirty = 1;
+    /* Palette index of the current attributes. */
+    u16 attr() {
+        if (!attrs_equal(this->attrs, this->last_attrs)) {
+            this->last_attr  = this->intern(this->attrs);
+            this->last_attrs = this->attrs;
         }
+        return this->last_attr;
     }
 
-    void write_to_buffer(yed_buffer *buffer) {
-        BUFF_WRITABLE_GUARD(buffer);
+    const yed_attrs& attrs_of(const Cell &cell) const { return this->palette[cell.attr]; }
 
-        yed_line new_line = yed_new_line_with_cap(this->width);
+    /* resolve_colors() of a palette entry, kept until the palette or the colors change. */
+    const yed_attrs& resolved_attrs(u16 attr) {
+        if (this->resolved_gen != colors_gen) {
+            this->resolved.clear();
+            this->resolved_gen = colors_gen;
+        }
 
-        int row = 1;
-        auto n_lines = this->lines.size();
-        for (int i = 0; i < n_lines; i += 1) {
-            auto &line = (*this)[i];
-            if (line.dirty) {
-                int n = line.size();
+        for (size_t i = this->resolved.size(); i <= attr; i += 1) {
+            this->resolved.push_back(resolve_colors(this->palette[i]));
+        }
 
-                yed_clear_line(&new_line);
+        return this->resolved[attr];
+    }
 
-                for (; n >= 1; n -= 1) {
-                    if (line[n - 1].glyph.c != 0
-                    ||  line[n - 1].attrs.flags != 0) { break; }
-                }
+    int n_rows() const { return this->ring.size(); }
 
-                for (int i = 0; i < n; i += 1) {
-                    yed_line_append_glyph(&new_line, line[i].glyph.c ? &(line[i].glyph) : GLYPH(" "));
-                }
+    /* Buffer rows above the ones this screen owns. */
+    int base() const { return this->scrollback - this->hot - this->cold.cap; }
 
-                yed_buff_set_line_no_undo(buffer, row, &new_line);
+    /* Makes this the alternate screen, which sits below the main screen's scrollback in the buffer. */
+    void drop_history() {
+        this->hot = 0;
+        this->cold.set_cap(0);
+    }
 
-                line.dirty = 0;
-            }
-            row += 1;
+    /* Everything but what can be rebuilt from the palette, dirty spans and all. */
+    void save(Snapshot &snap) const {
+        snap.put(this->cells);
+        snap.put((u64)this->slots.size());
+        for (auto &line : this->slots) {
+            snap.put((u64)(line.cells - this->cells.data()));
+            snap.put(line.len);
+            snap.put(line.dirty_l);
+            snap.put(line.dirty_r);
+            snap.put(line.pos);
+            snap.put(line.wrapped);
         }
-
-        yed_free_line(&new_line);
+        snap.put(this->ring);
+        snap.put(this->spare);
+        snap.put(this->dirty);
+        snap.put(this->head);
+        snap.put(this->stride);
+        snap.put(this->width);
+        snap.put(this->height);
+        snap.put(this->cursor_row);
+        snap.put(this->cursor_col);
+        snap.put(this->cursor_row_save);
+        snap.put(this->cursor_col_save);
+        snap.put(this->attrs_save);
+        snap.put(this->cursor_saved);
+        snap.put(this->scroll_t);
+        snap.put(this->scroll_b);
+        snap.put(this->scrollback);
+        snap.put(this->hot);
+        snap.put(this->reflows);
+        snap.put(this->palette);
+        snap.put(this->palette_grace);
+        this->cold.save(snap);
     }
-};
 
+    void load(Snapshot &snap) {
+        u64 n_slots;
 
-struct Term {
-    int                valid           = 0;
-    int                master_fd       = 0;
-    int                slave_fd        = 0;
-    int                sig_fds[2]      = { 0, 0 };
-    pid_t              shell_pid       = 0;
-    int                process_exited  = 0;
-    int                bad_shell       = 0;
-    std::thread        thr;
-    std::mutex         buff_lock;
-    std::vector<char>  data_buff;
-    int                max_block_size  = 0;
-    int                read_chunk_size = 0;
-    int                delay_update    = 0;
-    int                update_waiting  = 0;
-    yed_buffer        *buffer          = NULL;
-    yed_attrs          current_attrs   = ZERO_ATTR;
-    Screen             main_screen;
-    Screen             alt_screen;
-    Screen            *_screen         = NULL;
-    int                app_keys        = 0;
-    int                auto_wrap       = 1;
-    int                wrap_next       = 0;
-    std::string        title;
-    int                term_mode       = 1;
-
-    static void read_thread(Term *term) {
-        struct pollfd pfds[2];
-        ssize_t       n;
-
-        pfds[0].fd      = term->master_fd;
-        pfds[0].events  = POLLIN;
-        pfds[0].revents = 0;
-        pfds[1].fd      = term->sig_fds[0];
-        pfds[1].events  = POLLIN;
-        pfds[1].revents = 0;
-
-        for (;;) {
-            if (poll(pfds, 2, -1) <= 0) {
-                if (errno) {
-                    if (errno != EINTR) {
-                        term->process_exited = 1;
-                    }
+        snap.get(this->cells);
+        snap.get(n_slots);
+        if (snap.left() < n_slots) {
+            snap.bad = 1;
+            return;
+        }
+
+        this->slots.resize(n_slots);
+        for (auto &line : this->slots) {
+            u64 off;
+
+            snap.get(off);
+            snap.get(line.len);
+            snap.get(line.dirty_l);
+            snap.get(line.dirty_r);
+            snap.get(line.pos);
+            snap.get(line.wrapped);
+
+            if (line.len < 0 || off > this->cells.size() || this->cells.size() - off < (u64)line.len) {
+                snap.bad = 1;
+                return;
+            }
+            line.cells = this->cells.data() + off;
+        }
+        snap.get(this->ring);
+        snap.get(this->spare);
+        snap.get(this->dirty);
+        snap.get(this->head);
+        snap.get(this->stride);
+        snap.get(this->width);
+        snap.get(this->height);
+        snap.get(this->cursor_row);
+        snap.get(this->cursor_col);
+        snap.get(this->cursor_row_save);
+        snap.get(this->cursor_col_save);
+        snap.get(this->attrs_save);
+        snap.get(this->cursor_saved);
+        snap.get(this->scroll_t);
+        snap.get(this->scroll_b);
+        snap.get(this->scrollback);
+        snap.get(this->hot);
+        snap.get(this->reflows);
+        snap.get(this->palette);
+        snap.get(this->palette_grace);
+        this->cold.load(snap);
+
+        for (auto idx : this->ring)  { if (idx < 0 || (u64)idx >= n_slots) { snap.bad = 1; } }
+        for (auto idx : this->spare) { if (idx < 0 || (u64)idx >= n_slots) { snap.bad = 1; } }
+        for (auto idx : this->dirty) { if (idx < 0 || (u64)idx >= n_slots) { snap.bad = 1; } }
+        for (auto &cell : this->cells) {
+            if (cell.attr >= this->palette.size()) { snap.bad = 1; break; }
+        }
+        if (this->palette.empty() || this->head < 0 || (this->head > 0 && this->head >= this->n_rows())) { snap.bad = 1; }
+        if (snap.bad) { return; }
+
+        this->palette_map.clear();
+        for (int i = 0; i < this->palette.size(); i += 1) {
+            this->palette_map[this->palette[i]] = i;
+        }
+        this->resolved.clear();
+        this->last_attrs = ZERO_ATTR;
+        this->last_attr  = 0;
+    }
+
+    int slot(int idx) const {
+        int p = this->head + idx;
+        if (p >= this->n_rows()) { p -= this->n_rows(); }
+        return this->ring[p];
+    }
+
+    void place(int idx, int s) {
+        int p = this->head + idx;
+        if (p >= this->n_rows()) { p -= this->n_rows(); }
+        this->ring[p]      = s;
+        this->slots[s].pos = p;
+    }
+
+    /* Logical row index of a slot. */
+    int index_of(const Line &line) const {
+        int idx = line.pos - this->head;
+        if (idx < 0) { idx += this->n_rows(); }
+        return idx;
+    }
+
+    /* Adds cells [from, to) of line to its dirty span. */
+    void mark(Line &line, int from, int to) {
+        if (from >= to) { return; }
+
+        if (!line.is_dirty()) {
+            this->dirty.push_back(&line - this->slots.data());
+            line.dirty_l = from;
+            line.dirty_r = to;
+        } else {
+            line.dirty_l = MIN(line.dirty_l, from);
+            line.dirty_r = MAX(line.dirty_r, to);
+        }
+    }
+
+    void mark_all(Line &line) { this->mark(line, 0, line.size()); }
+
+    Line& operator[](std::size_t idx)             { return this->slots[this->slot(idx)]; }
+    const Line& operator[](std::size_t idx) const { return this->slots[this->slot(idx)]; }
+
+    void set_cursor(int row, int col) {
+        this->cursor_row = row; LIMIT(this->cursor_row, 1, this->height);
+        this->cursor_col = col; LIMIT(this->cursor_col, 1, this->width);
+    }
+
+    void move_cursor(int rows, int cols) {
+        this->set_cursor(this->cursor_row + rows, this->cursor_col + cols);
+    }
+
+    void save_cursor() {
+        this->cursor_row_save = this->cursor_row;
+        this->cursor_col_save = this->cursor_col;
+        this->attrs_save      = this->attrs;
+        this->cursor_saved    = 1;
+    }
+
+    void restore_cursor() {
+        this->cursor_row   = this->cursor_row_save;
+        this->cursor_col   = this->cursor_col_save;
+        this->attrs        = this->attrs_save;
+        this->cursor_saved = 0;
+    }
+
+    void make_dirty() {
+        for (int s : this->ring) { this->mark_all(this->slots[s]); }
+        this->cold.make_stale();
+    }
+
+    void make_viewport_dirty() {
+        for (int i = this->hot; i < this->n_rows(); i += 1) {
+            this->mark_all((*this)[i]);
+        }
+    }
+
+    /* Like make_dirty(), for a buffer whose rows are all still empty. */
+    void make_used_dirty() {
+        for (int s : this->ring) {
+            auto &line = this->slots[s];
+            if (this->used_len(line) > 0) { this->mark_all(line); }
+        }
+        this->cold.make_stale();
+    }
+
+    /* Number of cells that write_to_buffer() would write for this line. */
+    int used_len(const Line &line) const {
+        int n = line.size();
+
+        for (; n >= 1; n -= 1) {
+            if (line[n - 1].glyph.c != 0
+            ||  this->attrs_of(line[n - 1]).flags != 0) { break; }
+        }
+
+        return n;
+    }
+
+    /* Cells of a row that go to cold: a wrapped row keeps all of them so that rejoining it keeps its spacing. */
+    int retire_len(const Line &line, int width) const {
+        return line.wrapped ? width : this->used_len(line);
+    }
+
+    /* Moves the top ring row into the cold tier. The caller reuses its slot. */
+    void retire_top() {
+        if (this->cold.cap == 0) { return; }
+
+        auto &line = (*this)[0];
+        this->cold.push(line, this->retire_len(line, this->width), this->palette, !line.is_dirty());
+    }
+
+    /* Moves the row at logical index last to first, shifting [first, last) down by one. */
+    void rotate_down(int first, int last) {
+        int s = this->slot(last);
+        for (int i = last; i > first; i -= 1) {
+            this->place(i, this->slot(i - 1));
+        }
+        this->place(first, s);
+    }
+
+    /* Moves the row at logical index first to last, shifting (first, last] up by one. */
+    void rotate_up(int first, int last) {
+        int s = this->slot(first);
+        for (int i = first; i < last; i += 1) {
+            this->place(i, this->slot(i + 1));
+        }
+        this->place(last, s);
+    }
+
+    /*
+     * Reorders rows the way deleting del_row and then inserting a row at new_row would
+     * (both 1-based). The moved row keeps its cells; callers clear it.
+     */
+    void move_line(int del_row, int new_row) {
+        if (del_row < new_row) {
+            if (del_row == 1 && new_row - 1 > this->n_rows() - new_row) {
+                /* Cheaper to spin the whole ring and fix up the rows below new_row. */
+                this->head += 1;
+                if (this->head == this->n_rows()) { this->head = 0; }
+                this->rotate_down(new_row - 1, this->n_rows() - 1);
+            } else {
+                this->rotate_up(del_row - 1, new_row - 1);
+            }
+        } else if (del_row > new_row) {
+            this->rotate_down(new_row - 1, del_row - 1);
+        }
+    }
+
+    void set_scroll(int top, int bottom) {
+        this->scroll_t = top;    LIMIT(this->scroll_t, 0, this->height);
+        this->scroll_b = bottom; LIMIT(this->scroll_b, 0, this->height);
+    }
+
+    int sctop()    { return this->scroll_t ? this->scroll_t : 1;            }
+    int scbottom() { return this->scroll_b ? this->scroll_b : this->height; }
+
+    void set(int row, int col, yed_glyph *g) {
+        if (row > this->height || col > this->width) { return; }
+
+        auto &line = (*this)[this->hot + row - 1];
+        auto &cell = line[col - 1];
+
+        cell.glyph = yed_glyph_copy(g);
+
+        u16 attr  = this->attr();
+        int width = yed_get_glyph_width(g);
+        int i;
+        for (i = 0; i < width; i += 1) {
+            if (col + i > this->width) { break; }
+            auto &cell = line[col - 1 + i];
+            cell.attr = attr;
+        }
+
+        this->mark(line, col - 1, col - 1 + MAX(i, 1));
+    }
+
+    void set_current_cell(yed_glyph *g) {
+        this->set(this->cursor_row, this->cursor_col, g);
+    }
+
+    /* Writes n single-width ASCII glyphs starting at (row, col). The caller keeps them within the row. */
+    void set_ascii(int row, int col, const char *s, int n) {
+        if (row > this->height || n <= 0) { return; }
+
+        auto &line = (*this)[this->hot + row - 1];
+        Cell *cell = &line[col - 1];
+        u16   attr = this->attr();
+
+        for (int i = 0; i < n; i += 1) {
+            cell[i].glyph.data = 0;
+            cell[i].glyph.c    = s[i];
+            cell[i].attr       = attr;
+        }
+
+        this->mark(line, col - 1, col - 1 + n);
+    }
+
+    void insert(int row, int col, yed_glyph *g) {
+        Cell new_cell;
+
+        new_cell.glyph = yed_glyph_copy(g);
+        new_cell.attr  = this->attr();
+
+        auto &line = (*this)[this->hot + row - 1];
+        memmove(&line[col], &line[col - 1], (line.size() - col) * sizeof(Cell));
+        line[col - 1] = new_cell;
+        this->mark(line, col - 1, line.size());
+    }
+
+    void del_cell(int row, int col) {
+        auto &line = (*this)[this->hot + row - 1];
+        memmove(&line[col - 1], &line[col], (line.size() - col) * sizeof(Cell));
+        line[line.size() - 1].glyph.data = 0;
+        line[line.size() - 1].attr       = this->attr();
+        this->mark(line, col - 1, line.size());
+    }
+
+    void clear_row(int row) {
+        auto &line = (*this)[this->hot + row - 1];
+        line.clear_cells(this->width, this->attr());
+        this->mark_all(line);
+    }
+
+    void set_wrapped(int row, int wrapped) {
+        (*this)[this->hot + row - 1].wrapped = wrapped;
+    }
+
+    /* Whether buffer row row ran on into the next one by autowrap. */
+    int row_wraps(int row) const {
+        row -= this->base();
+        if (row < 1)               { return 0;                                   }
+        if (row <= this->cold.cap) { return this->cold.get(row - 1).wrapped;     }
+        return (*this)[row - 1 - this->cold.cap].wrapped;
+    }
+
+    /* The buffer rows [*first, *last] that make up the logical line holding row. */
+    void logical_line(int row, int *first, int *last) const {
+        int n = this->base() + this->cold.cap + this->n_rows();
+
+        *first = row;
+        while (*first > this->base() + 1 && this->row_wraps(*first - 1)) { *first -= 1; }
+
+        *last = row;
+        while (*last < n && this->row_wraps(*last)) { *last += 1; }
+    }
+
+    /*
+     * Appends the text that buffer row row shows in columns [from, to). A row that
+     * autowrapped keeps its trailing blanks, so that it joins up with the next one.
+     */
+    void row_text(int row, int from, int to, std::string &out) const {
+        int col = 1;
+
+        auto put = [&](const char *g) {
+            if (col >= from && col < to) { out.append(g, yed_get_glyph_len(GLYPH(g))); }
+            col += yed_get_glyph_width(GLYPH(g));
+        };
+
+        row -= this->base();
+        if (row < 1) { return; }
+
+        if (row <= this->cold.cap) {
+            auto l = this->cold.get(row - 1);
+
+            for (const char *p = l.text; p < l.text + l.len; p += yed_get_glyph_len(GLYPH(p))) { put(p); }
+
+            return;
+        }
+
+        auto &line = (*this)[row - 1 - this->cold.cap];
+        int   n    = line.wrapped ? MIN(line.size(), this->width) : this->used_len(line);
+
+        for (int i = 0; i < n; i += 1) {
+            put(line[i].glyph.c ? line[i].glyph.bytes : " ");
+        }
+    }
+
+    /*
+     * Finds the last match of pat that starts before buffer position (row, col) and
+     * puts it in *hit_row and *hit_col. Matches can run across autowraps. Cold blocks
+     * whose trigram filter rules pat out aren't looked at.
+     */
+    int search(const std::string &pat, int row, int col, int *hit_row, int *hit_col) {
+        Cold_Block ring;
+
+        if (pat.empty()) { return 0; }
+
+        for (int i = 0; i < this->n_rows(); i += 1) {
+            auto &line = (*this)[i];
+            int   len  = line.wrapped ? this->width : this->used_len(line);
+
+            for (int j = 0; j < len; j += 1) {
+                const Cell &cell = line[j];
+
+                if (cell.glyph.c) {
+                    ring.text.append(cell.glyph.bytes, yed_get_glyph_len((yed_glyph*)&cell.glyph));
+                } else {
+                    ring.text += ' ';
+                }
+            }
+
+            ring.text_offs.push_back(ring.text.size());
+            ring.wrapped.push_back(line.wrapped);
+        }
+
+        if (row > this->base() + this->cold.cap
+        &&  search_block(ring, 0, this->base() + this->cold.cap + 1, NULL, pat, row, col, hit_row, hit_col)) {
+            return 1;
+        }
+
+        for (int b = (int)this->cold.blocks.size() - 1; b >= 0; b -= 1) {
+            auto &block = this->cold.blocks[b];
+            auto *next  = b + 1 < (int)this->cold.blocks.size() ? &this->cold.blocks[b + 1] : &ring;
+            int   base  = this->cold.blank - this->cold.first + b * COLD_BLOCK_LINES + 1;
+            int   skip  = b == 0 ? this->cold.first : 0;
+
+            if (base + skip > row) { continue; }
+
+            /* The filter only knows about the block's own text, so a match may hide where it runs on into next. */
+            if (!block.may_contain(pat) && !(block.n_lines() > 0 && block.wrapped.back())) { continue; }
+
+            if (search_block(block, skip, base, next, pat, row, col, hit_row, hit_col)) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    void push_op(int del_row, int new_row) {
+        if (!this->row_ops.empty()
+        &&  this->row_ops.back().del_row == del_row
+        &&  this->row_ops.back().new_row == new_row) {
+
+            this->row_ops.back().count += 1;
+        } else {
+            this->row_ops.push_back({ del_row, new_row, 1 });
+        }
+    }
+
+    /*
+     * Replays the row moves from row_ops on the buffer, or marks the rows to be rewritten
+     * in place instead when that is cheaper. Every move is a delete and an insert that
+     * shift all the rows below it. With term mode off that is the whole scrollback, and
+     * rows are only rewritten once a frame reaches them, so anything more than a few
+     * moves is rewritten. With it on, the buffer is only the screen: shifting it is cheap
+     * next to writing all of its rows, so that is only done once the moves add up to the
+     * whole screen and lines that scrolled all the way out never touch the buffer.
+     * A move that starts above buffer_top starts at the buffer's first row instead.
+     * Must be called before anything else moves buffer rows.
+     */
+    void apply_row_ops(yed_buffer *buffer) {
+        int n      = 0;
+        int n_rows = this->base() + this->cold.cap + this->n_rows() - MAX(this->buffer_top, this->base());
+        int lazy   = this->buffer_top < this->scrollback;
+
+        if (this->row_ops.empty()) { return; }
+
+        for (auto &op : this->row_ops) { n += op.count; }
+
+        if (n >= n_rows || (lazy && n > MAX_SHIFTED_ROWS)) {
+            this->make_dirty();
+        } else {
+            BUFF_WRITABLE_GUARD(buffer);
+
+            for (auto &op : this->row_ops) {
+                for (int i = 0; i < op.count; i += 1) {
+                    yed_buff_delete_line_no_undo(buffer, MAX(op.del_row - this->buffer_top, 1));
+                    yed_buff_insert_line_no_undo(buffer, op.new_row - this->buffer_top);
+                }
+            }
+        }
+
+        this->row_ops.clear();
+    }
+
+    /*
+     * Follows a row of the buffer, counted from its real first row, through the row
+     * moves that haven't been applied yet. Returns the row that now holds that line,
+     * or 0 if it has scrolled out.
+     */
+    int model_row(int row) const {
+        int base = this->base();
+
+        row += this->buffer_top;
+
+        for (auto &op : this->row_ops) {
+            if (op.del_row == base + 1 && op.new_row == base + this->cold.cap + this->n_rows()) {
+                if (row <= base) { continue; }
+                row -= op.count;
+                if (row <= base) { return 0; }
+                continue;
+            }
+
+            for (int i = 0; i < op.count; i += 1) {
+                if (row == op.del_row) { return 0; }
+                if (row >  op.del_row) { row -= 1; }
+                if (row >= op.new_row) { row += 1; }
+            }
+        }
+
+        return row;
+    }
+
+    void scroll_up() {
+        int del_row = this->scroll_t ? this->scrollback + this->scroll_t : this->base() + 1;
+        int new_row = this->scrollback + this->scbottom();
+
+        if (this->scroll_t) {
+            this->move_line(this->hot + this->scroll_t, this->hot + this->scbottom());
+        } else {
+            this->retire_top();
+            this->move_line(1, this->hot + this->scbottom());
+        }
+        this->clear_row(this->scbottom());
+
+        this->push_op(del_row, new_row);
+
+        ASSERT(this->base() + this->cold.cap + this->n_rows() == this->scrollback + this->height, "rows mismatch");
+    }
+
+    void scroll_down() {
+        int del_row = this->scrollback + this->scbottom();
+        int new_row = this->scrollback + (this->scroll_t ? this->scroll_t : 1);
+
+        this->move_line(del_row - this->base() - this->cold.cap, new_row - this->base() - this->cold.cap);
+        this->clear_row(new_row - this->scrollback);
+
+        this->push_op(del_row, new_row);
+
+        ASSERT(this->base() + this->cold.cap + this->n_rows() == this->scrollback + this->height, "rows mismatch");
+    }
+
+    void insert_line(int row) {
+        int del_row = this->scrollback + this->scbottom();
+        int new_row = this->scrollback + row;
+
+        this->move_line(del_row - this->base() - this->cold.cap, new_row - this->base() - this->cold.cap);
+        this->clear_row(new_row - this->scrollback);
+
+        this->push_op(del_row, new_row);
+
+        ASSERT(this->base() + this->cold.cap + this->n_rows() == this->scrollback + this->height, "rows mismatch");
+    }
+
+    void delete_line(int row) {
+        int del_row = this->scrollback + row;
+        int new_row = this->scrollback + this->scbottom();
+
+        this->move_line(del_row - this->base() - this->cold.cap, new_row - this->base() - this->cold.cap);
+        this->clear_row(new_row - this->scrollback);
+
+        this->push_op(del_row, new_row);
+
+        ASSERT(this->base() + this->cold.cap + this->n_rows() == this->scrollback + this->height, "rows mismatch");
+    }
+
+    /*
+     * Sets the number of rows, dropping blank rows from the bottom and then retiring
+     * rows from the top into cold scrollback when there are too many. *cut_top and
+     * *cut_bottom get how many went from each end.
+     */
+    void reshape(int num_lines, int stride, int *cut_top, int *cut_bottom) {
+        int first = 0;
+        int last  = this->n_rows();
+
+        while (last - first > num_lines) {
+            if ((*this)[last - 1][0].glyph.c == 0) {
+                last -= 1;
+            } else {
+                auto &line = (*this)[first];
+                this->cold.push(line, this->retire_len(line, this->width), this->palette, !line.is_dirty());
+                first += 1;
+            }
+        }
+
+        *cut_top    = first;
+        *cut_bottom = this->n_rows() - last;
+
+        if (stride == this->stride) {
+            this->relink(num_lines, first, last);
+        } else {
+            this->restride(num_lines, stride, first, last);
+        }
+
+        this->dirty.clear();
+        for (int s : this->ring) {
+            if (this->slots[s].is_dirty()) { this->dirty.push_back(s); }
+        }
+    }
+
+    /*
+     * Height-only reshape. Rows [first, last) keep their cells where they are; rows
+     * that are cut go to the spare list and new rows come from it, so dragging a
+     * split only touches the rows that come and go.
+     */
+    void relink(int num_lines, int first, int last) {
+        std::vector<int> ring(num_lines);
+        int              kept = last - first;
+        int              need;
+
+        for (int i = 0; i < this->n_rows(); i += 1) {
+            if (i >= first && i < last) { continue; }
+
+            auto &line = this->slots[this->slot(i)];
+            line.dirty_l = line.dirty_r = 0;
+            line.pos     = -1;
+            this->spare.push_back(this->slot(i));
+        }
+
+        for (int i = 0; i < kept; i += 1) {
+            ring[i] = this->slot(first + i);
+        }
+
+        need = num_lines - kept - (int)this->spare.size();
+        if (need > 0) {
+            Cell *old = this->cells.data();
+            int   n   = this->slots.size();
+
+            this->cells.resize((size_t)(n + need) * this->stride);
+            this->slots.resize(n + need);
+
+            for (int s = 0; s < n + need; s += 1) {
+                if (s >= n) {
+                    this->spare.push_back(s);
+                    this->slots[s].len = this->stride;
+                } else if (this->cells.data() == old) {
+                    continue;
+                }
+                this->slots[s].cells = &this->cells[(size_t)s * this->stride];
+            }
+        }
+
+        for (int i = kept; i < num_lines; i += 1) {
+            int s = this->spare.back();
+            this->spare.pop_back();
+
+            this->slots[s].clear_cells(this->stride, this->attr());
+            ring[i] = s;
+        }
+
+        this->ring.swap(ring);
+        this->head = 0;
+
+        for (int i = 0; i < num_lines; i += 1) {
+            this->slots[this->ring[i]].pos = i;
+        }
+    }
+
+    /* Copies rows [first, last) into a new slab with a wider stride. */
+    void restride(int num_lines, int stride, int first, int last) {
+        std::vector<Cell> cells;
+        std::vector<Line> slots(num_lines);
+        std::vector<int>  ring(num_lines);
+        Cell              blank;
+
+        blank.glyph.data = 0;
+        blank.attr       = this->attr();
+
+        cells.resize((size_t)num_lines * stride, blank);
+
+        for (int i = 0; i < num_lines; i += 1) {
+            auto &line = slots[i];
+
+            line.cells = &cells[(size_t)i * stride];
+            line.len   = stride;
+            line.pos   = i;
+            ring[i]    = i;
+
+            if (first + i < last) {
+                auto &old = (*this)[first + i];
+                memcpy(line.cells, old.cells, MIN(old.size(), stride) * sizeof(Cell));
+                line.dirty_l = old.dirty_l;
+                line.dirty_r = MIN(old.dirty_r, stride);
+                line.wrapped = old.wrapped;
+            }
+        }
+
+        this->cells.swap(cells);
+        this->slots.swap(slots);
+        this->ring.swap(ring);
+        this->spare.clear();
+        this->head   = 0;
+        this->stride = stride;
+    }
+
+    /*
+     * Width change on a screen that reflows: rewraps every logical line of the ring to
+     * width in one pass, keeping the cursor on the same character, then fits the rows
+     * into num_lines around the cursor. Rows past the top retire into cold and rows
+     * past the bottom are dropped. The newest cold lines are rewrapped and brought back
+     * when the top ring row continues one of them, or when there are too few rows above
+     * the cursor; *cut_top is then negative by how many. Every ring row is left dirty.
+     */
+    void reflow(int num_lines, int width, int stride, int *cut_top, int *cut_bottom) {
+        std::vector<Cell> out;
+        std::vector<u8>   wraps;
+        std::vector<Cell> pre;
+        std::vector<u8>   pre_wraps;
+        std::vector<Cell> text;
+        std::vector<Cell> carry;
+        Cell              blank;
+        int               height  = num_lines - this->hot;
+        int               cur     = this->hot + this->cursor_row - 1;
+        int               cur_row = 0;
+        int               cur_col = 1;
+        int               pulled  = 0;
+
+        blank.glyph.data = 0;
+        blank.attr       = 0;
+
+        /* Splits text, padded out to goal cells, into rows. Returns the row holding cell k, or -1. */
+        auto split = [&](std::vector<Cell> &rows, std::vector<u8> &row_wraps, int goal, int k, int *col) {
+            int found = -1;
+            int off   = 0;
+
+            do {
+                int    n  = MIN(width, goal - off);
+                size_t at = rows.size();
+
+                /* A wide glyph that would straddle the margin starts the next row instead. */
+                if (n == width && n > 1 && off + n <= (int)text.size()
+                &&  text[off + n - 1].glyph.c
+                &&  yed_get_glyph_width((yed_glyph*)&text[off + n - 1].glyph) > 1) {
+                    n -= 1;
+                }
+
+                rows.resize(at + stride, blank);
+                for (int j = off; j < off + n && j < (int)text.size(); j += 1) {
+                    rows[at + j - off] = text[j];
+                }
+                row_wraps.push_back(1);
+
+                if (k >= off && k < off + n) {
+                    found = row_wraps.size() - 1;
+                    *col  = k - off + 1;
+                }
+
+                off += n;
+            } while (off < goal);
+
+            row_wraps.back() = 0;
+
+            return found;
+        };
+
+        /* Takes the newest logical line out of cold, decoded into cells. */
+        auto pull_cold = [&](std::vector<Cell> &cells) {
+            int last  = this->cold.cap - 1;
+            int first = last;
+
+            while (first > this->cold.blank && this->cold.get(first - 1).wrapped) { first -= 1; }
+
+            cells.clear();
+            for (int i = first; i <= last; i += 1) { this->decode_cold(this->cold.get(i), cells); }
+            for (int i = first; i <= last; i += 1) { this->cold.pop_newest(); }
+
+            pulled += last - first + 1;
+        };
+
+        if (this->cold.blank < this->cold.cap && this->cold.get(this->cold.cap - 1).wrapped) {
+            pull_cold(carry);
+        }
+
+        for (int i = 0; i < this->n_rows();) {
+            int start = i;
+            int k     = -1;
+            int goal;
+            int row;
+
+            text.clear();
+            if (start == 0) { text.swap(carry); }
+            int before = text.size();
+
+            for (;;) {
+                auto &line = (*this)[i];
+                int   cont = line.wrapped && i < this->n_rows() - 1;
+                int   len  = cont ? this->width : MIN(this->used_len(line), this->width);
+
+                text.insert(text.end(), line.cells, line.cells + len);
+                i += 1;
+                if (!cont) { break; }
+            }
+
+            goal = text.size();
+            if (cur >= start && cur < i) {
+                k    = before + (cur - start) * this->width + this->cursor_col - 1;
+                goal = MAX(goal, k + 1);
+            }
+
+            row = split(out, wraps, goal, k, &cur_col);
+            if (row >= 0) { cur_row = row; }
+        }
+
+        /* The cursor keeps its row unless that would push text below it off the screen. */
+        int n_out = wraps.size();
+        int below = 0;
+        for (int r = n_out - 1; r > cur_row; r -= 1) {
+            Line line;
+            line.cells = &out[(size_t)r * stride];
+            line.len   = stride;
+
+            if (this->used_len(line) > 0) {
+                below = r - cur_row;
+                break;
+            }
+        }
+
+        int want = this->hot + MAX(1, MIN(this->cursor_row, height - below)) - 1;
+
+        while (cur_row + (int)pre_wraps.size() < want && this->cold.blank < this->cold.cap) {
+            std::vector<Cell> rows;
+            std::vector<u8>   row_wraps;
+            int               unused;
+
+            pull_cold(text);
+            split(rows, row_wraps, text.size(), -1, &unused);
+
+            pre.insert(pre.begin(), rows.begin(), rows.end());
+            pre_wraps.insert(pre_wraps.begin(), row_wraps.begin(), row_wraps.end());
+        }
+
+        int n_pre = pre_wraps.size();
+        int n_all = n_pre + n_out;
+        int first = MAX(0, n_pre + cur_row - want);
+        int pad   = MAX(0, want - n_pre - cur_row);
+
+        auto row_line = [&](int r) {
+            Line line;
+            line.cells   = r < n_pre ? &pre[(size_t)r * stride] : &out[(size_t)(r - n_pre) * stride];
+            line.len     = stride;
+            line.wrapped = r < n_pre ? pre_wraps[r] : wraps[r - n_pre];
+            return line;
+        };
+
+        for (int r = 0; r < first; r += 1) {
+            auto line = row_line(r);
+            this->cold.push(line, this->retire_len(line, width), this->palette, 0);
+        }
+
+        *cut_top    = first - pulled;
+        *cut_bottom = MAX(0, this->n_rows() + pulled - first - num_lines);
+
+        std::vector<Cell> cells;
+        std::vector<Line> slots(num_lines);
+        std::vector<int>  ring(num_lines);
+
+        cells.resize((size_t)num_lines * stride, blank);
+
+        for (int i = 0; i < num_lines; i += 1) {
+            auto &line = slots[i];
+            int   src  = first + i - pad;
+
+            line.cells   = &cells[(size_t)i * stride];
+            line.len     = stride;
+            line.pos     = i;
+            line.dirty_l = 0;
+            line.dirty_r = stride;
+            ring[i]      = i;
+
+            if (src >= 0 && src < n_all) {
+                auto from = row_line(src);
+                memcpy(line.cells, from.cells, stride * sizeof(Cell));
+                line.wrapped = from.wrapped;
+            }
+        }
+
+        this->cells.swap(cells);
+        this->slots.swap(slots);
+        this->ring.swap(ring);
+        this->spare.clear();
+        this->dirty  = this->ring;
+        this->head   = 0;
+        this->stride = stride;
+
+        this->cursor_row = want - this->hot + 1;
+        this->cursor_col = cur_col;
+    }
+
+    /* Appends a cold line's cells to cells. Doesn't collect the palette, so cells outside the slab stay valid. */
+    void decode_cold(const Cold_Line &l, std::vector<Cell> &cells) {
+        size_t base = cells.size();
+
+        for (const char *p = l.text; p < l.text + l.len; p += yed_get_glyph_len(GLYPH(p))) {
+            Cell cell;
+            cell.glyph.data = 0;
+            cell.attr       = 0;
+            memcpy(cell.glyph.bytes, p, yed_get_glyph_len(GLYPH(p)));
+            cells.push_back(cell);
+        }
+
+        for (int i = 0; i < l.n_runs; i += 1) {
+            auto &run  = l.runs[i];
+            u16   attr = this->intern(run.attrs, /* may_collect = */ 0);
+
+            for (size_t c = base + run.col; c < base + run.col + run.len && c < cells.size(); c += 1) {
+                cells[c].attr = attr;
+            }
+        }
+    }
+
+    void set_dimensions(int width, int height, int *cut_top = NULL, int *cut_bottom = NULL) {
+        int num_lines  = height + this->hot;
+        int new_stride = this->stride;
+        int top        = 0;
+        int bottom     = 0;
+
+        /* Rounded up so that widening a frame a column at a time doesn't copy every row each time. */
+        if (width > new_stride) {
+            new_stride = (width + STRIDE_ALIGN - 1) / STRIDE_ALIGN * STRIDE_ALIGN;
+        }
+
+        if (this->reflows && this->width > 0 && width != this->width) {
+            this->reflow(num_lines, width, new_stride, &top, &bottom);
+        } else if (num_lines != this->n_rows() || new_stride != this->stride) {
+            this->reshape(num_lines, new_stride, &top, &bottom);
+        }
+
+        if (cut_top    != NULL) { *cut_top    = top;    }
+        if (cut_bottom != NULL) { *cut_bottom = bottom; }
+
+        this->width  = width;
+        this->height = height;
+
+        LIMIT(this->scroll_t, 0, this->height);
+        LIMIT(this->scroll_b, 0, this->height);
+
+        LIMIT(this->cursor_row, 1, this->height);
+        LIMIT(this->cursor_col, 1, this->width);
+
+        for (int row = MAX(1, this->hot - this->height); row < this->hot + this->height; row += 1) {
+            this->mark_all((*this)[row - 1]);
+        }
+    }
+
+    /*
+     * Rows above first_row are nobody's to look at right now, and rows below last_row
+     * belong to another screen for now. Their lines stay dirty and are written by a
+     * later call that does reach them.
+     * Returns the number of rows written.
+     */
+    int write_to_buffer(yed_buffer *buffer, int first_row = 1, int last_row = INT_MAX) {
+        int    n_written = 0;
+        size_t n_kept    = 0;
+
+        this->apply_row_ops(buffer);
+
+        BUFF_WRITABLE_GUARD(buffer);
+
+        first_row = MAX(first_row, this->buffer_top + 1);
 
-                    errno = 0;
+        yed_line new_line = yed_new_line_with_cap(this->width);
 
-                    if (term->process_exited) {
-                        return;
-                    }
+        /* Only the cold lines in [first_row, last_row] are decoded, so a frame scrolled into them pays for what it shows. */
+        for (int i = MAX(first_row - this->base(), 1) - 1; i < MIN(last_row - this->base(), this->cold.cap); i += 1) {
+            if (!this->cold.is_stale(i)) { continue; }
+
+            this->write_cold_line(buffer, this->base() + i + 1, i, new_line);
+            this->cold.set_flushed(i);
+            n_written += 1;
+        }
+
+        for (int s : this->dirty) {
+            auto &line = this->slots[s];
+            int   row  = this->base() + this->cold.cap + this->index_of(line) + 1;
+
+            if (row < first_row || row > last_row) {
+                this->dirty[n_kept] = s;
+                n_kept += 1;
+                continue;
+            }
+
+            if (!this->patch_line(buffer, row, line)) {
+                this->write_line(buffer, row, line, new_line);
+            }
+
+            line.dirty_l = line.dirty_r = 0;
+            n_written += 1;
+        }
+        this->dirty.resize(n_kept);
+
+        yed_free_line(&new_line);
+
+        return n_written;
+    }
+
+    /*
+     * Writes what row holds to buffer row buffer_row, which model_row() says shows it,
+     * unless the buffer already has it there. Row moves that are still queued are left
+     * alone, so no row moves under a frame that is looking at it. The caller tidies
+     * dirty afterward. Returns whether it wrote anything.
+     */
+    int fill_row(yed_buffer *buffer, int buffer_row, int row, yed_line &new_line) {
+        row -= this->base();
+        if (row < 1) { return 0; }
+
+        if (row <= this->cold.cap) {
+            if (!this->cold.is_stale(row - 1)) { return 0; }
+
+            this->write_cold_line(buffer, buffer_row, row - 1, new_line);
+            this->cold.set_flushed(row - 1);
+
+            return 1;
+        }
+
+        auto &line = (*this)[row - this->cold.cap - 1];
+
+        if (!line.is_dirty()) { return 0; }
+
+        this->write_line(buffer, buffer_row, line, new_line);
+        line.dirty_l = line.dirty_r = 0;
+
+        return 1;
+    }
+
+    /* Drops the rows that fill_row() wrote from dirty. */
+    void tidy_dirty() {
+        size_t n_kept = 0;
+
+        for (int s : this->dirty) {
+            if (this->slots[s].is_dirty()) {
+                this->dirty[n_kept] = s;
+                n_kept += 1;
+            }
+        }
+        this->dirty.resize(n_kept);
+    }
+
+    void write_cold_line(yed_buffer *buffer, int row, int idx, yed_line &new_line) {
+        auto l = this->cold.get(idx);
+
+        yed_clear_line(&new_line);
+
+        for (const char *p = l.text; p < l.text + l.len; p += yed_get_glyph_len(GLYPH(p))) {
+            yed_line_append_glyph(&new_line, GLYPH(p));
+        }
+
+        yed_buff_set_line_no_undo(buffer, row - this->buffer_top, &new_line);
+    }
+
+    void write_line(yed_buffer *buffer, int row, const Line &line, yed_line &new_line) {
+        int n = this->used_len(line);
+
+        yed_clear_line(&new_line);
+
+        for (int i = 0; i < n; i += 1) {
+            yed_line_append_glyph(&new_line, line[i].glyph.c ? (yed_glyph*)&(line[i].glyph) : GLYPH(" "));
+        }
+
+        yed_buff_set_line_no_undo(buffer, row - this->buffer_top, &new_line);
+    }
+
+    /*
+     * Rewrites only the dirty span of a row in place when that takes a handful of glyph
+     * edits. The buffer row must hold what this line looked like at the last flush.
+     * Returns 0 when the whole row should be replaced instead.
+     */
+    int patch_line(yed_buffer *buffer, int row, const Line &line) {
+        yed_line *old;
+
+        row -= this->buffer_top;
+        old  = yed_buff_get_line(buffer, row);
+
+        if (old == NULL || old->visual_width != old->n_glyphs) { return 0; }
+
+        int n_old = old->n_glyphs;
+        int n_new = this->used_len(line);
+        int start = MIN(line.dirty_l, MIN(n_old, n_new));
+        int n_del = MAX(0, MIN(line.dirty_r, n_old) - start);
+        int n_ins = MAX(0, MIN(line.dirty_r, n_new) - start);
+
+        if (n_del + n_ins > MAX_PATCH_GLYPHS) { return 0; }
+
+        for (int i = start; i < start + n_ins; i += 1) {
+            if (line[i].glyph.c && yed_get_glyph_width((yed_glyph*)&line[i].glyph) != 1) { return 0; }
+        }
+
+        yed_glyph space;
+        space.data = 0;
+        space.c    = ' ';
+
+        for (int i = 0; i < n_del; i += 1) {
+            yed_delete_from_line_no_undo(buffer, row, start + 1);
+        }
+        for (int i = start; i < start + n_ins; i += 1) {
+            yed_insert_into_line_no_undo(buffer, row, i + 1, line[i].glyph.c ? line[i].glyph : space);
+        }
+
+        return 1;
+    }
+};
+
+
+/*
+ * Fixed-size byte ring that child output is staged in. service() read()s straight
+ * into write_span() and publishes the bytes with commit(), then parses them in
+ * place from read_span() and hands the space back with consume(). Both sides run
+ * on the I/O thread, and a snapshot only looks at the ring once that thread has
+ * stopped, so head and tail need no synchronization. They only ever grow, so
+ * size() is head - tail.
+ */
+struct Byte_Ring {
+    std::vector<char> buff;
+    size_t            mask = 0;
+    size_t            head = 0;
+    size_t            tail = 0;
+
+    /* Capacity is rounded up to a power of two. Drops whatever the ring held. */
+    void reserve(size_t cap) {
+        size_t n = 1;
+        while (n < cap) { n <<= 1; }
+
+        this->buff.assign(n, 0);
+        this->mask = n - 1;
+        this->head = 0;
+        this->tail = 0;
+    }
+
+    size_t capacity() const { return this->buff.size();      }
+    size_t size()     const { return this->head - this->tail; }
+
+    /* Contiguous free space at the head. */
+    char *write_span(size_t *len) {
+        size_t off = this->head & this->mask;
+
+        *len = MIN(this->capacity() - this->size(), this->capacity() - off);
+
+        return this->buff.data() + off;
+    }
+
+    void commit(size_t n) { this->head += n; }
+
+    /* Contiguous readable bytes at the tail, or skip bytes past it. */
+    const char *read_span(size_t *len, size_t skip = 0) {
+        size_t t   = this->tail + skip;
+        size_t off = t & this->mask;
+
+        *len = MIN(this->head - t, this->capacity() - off);
+
+        return this->buff.data() + off;
+    }
+
+    void consume(size_t n) { this->tail += n; }
+};
+
+static u64 measure_time_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Running totals shown by term-stats. Guarded by the terminal's model_lock. */
+struct Term_Stats {
+    u64    bytes_read     = 0;
+    u64    reads          = 0;
+    u64    csi            = 0;
+    u64    osc            = 0;
+    u64    dcs            = 0;
+    u64    lines_scrolled = 0;
+    u64    lines_flushed  = 0;
+    u64    updates        = 0;
+    u64    update_ns      = 0;
+    u64    flushes        = 0;
+    u64    flush_ns       = 0;
+    u64    read_pauses    = 0;
+    size_t input_depth    = 0;
+    size_t input_peak     = 0;
+    u64    last_published = 0;
+
+    std::vector<std::pair<const char*, u64> > list() const {
+        return {
+            { "bytes-read",     this->bytes_read       },
+            { "reads",          this->reads            },
+            { "csi",            this->csi              },
+            { "osc",            this->osc              },
+            { "dcs",            this->dcs              },
+            { "lines-scrolled", this->lines_scrolled   },
+            { "lines-flushed",  this->lines_flushed    },
+            { "updates",        this->updates          },
+            { "update-us",      this->update_ns / 1000 },
+            { "flushes",        this->flushes          },
+            { "flush-us",       this->flush_ns / 1000  },
+            { "read-pauses",    this->read_pauses      },
+            { "input-depth",    this->input_depth      },
+            { "input-peak",     this->input_peak       },
+        };
+    }
+};
+
+/*
+ * term-record files start with RECORDING_MAGIC. Each read from the child follows as
+ * a "<ms since start> <length>\n" header and then that many raw bytes.
+ */
+#define RECORDING_MAGIC "yed-terminal-recording 1\n"
+
+struct Recorded_Read {
+    u64         ms;
+    std::string bytes;
+};
+
+static int load_recording(const char *path, std::vector<Recorded_Read> &reads) {
+    FILE               *f;
+    unsigned long long  ms;
+    size_t              len;
+    char                magic[sizeof(RECORDING_MAGIC)];
+    int                 ok = 0;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        errno = 0;
+        return 0;
+    }
+
+    if (fread(magic, 1, sizeof(magic) - 1, f) == sizeof(magic) - 1
+    &&  memcmp(magic, RECORDING_MAGIC, sizeof(magic) - 1) == 0) {
+
+        ok = 1;
+        while (fscanf(f, "%llu %zu", &ms, &len) == 2 && fgetc(f) == '\n') {
+            Recorded_Read r;
+
+            r.ms = ms;
+            r.bytes.resize(len);
+            if (fread(&r.bytes[0], 1, len, f) != len) { break; }
+
+            reads.push_back(std::move(r));
+        }
+    }
+
+    fclose(f);
+
+    return ok;
+}
+
+#define POLL_READ  (1)
+#define POLL_WRITE (2)
+
+/*
+ * Moves fd's registration with poll_fd from the events in was to the events in
+ * now (POLL_READ | POLL_WRITE). was == 0 adds fd, now == 0 removes it.
+ */
+static void poll_set(int poll_fd, int fd, void *udata, int was, int now) {
+#ifdef __APPLE__
+    struct kevent evs[2];
+    int           n = 0;
+
+    if ((was ^ now) & POLL_READ) {
+        EV_SET(&evs[n], fd, EVFILT_READ, (now & POLL_READ) ? EV_ADD : EV_DELETE, 0, 0, udata);
+        n += 1;
+    }
+    if ((was ^ now) & POLL_WRITE) {
+        EV_SET(&evs[n], fd, EVFILT_WRITE, (now & POLL_WRITE) ? EV_ADD : EV_DELETE, 0, 0, udata);
+        n += 1;
+    }
+
+    if (n) { kevent(poll_fd, evs, n, NULL, 0, NULL); }
+#else
+    struct epoll_event ev;
+
+    if (was == now) { return; }
+
+    ev.events   = ((now & POLL_READ) ? EPOLLIN : 0) | ((now & POLL_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = udata;
+    epoll_ctl(poll_fd, was == 0 ? EPOLL_CTL_ADD : now == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &ev);
+#endif
+}
+
+struct Term {
+    int                      valid           = 0;
+    int                      master_fd       = 0;
+    int                      slave_fd        = 0;
+    pid_t                    shell_pid       = 0;
+    std::atomic<int>         process_exited  { 0 };
+    int                      bad_shell       = 0;
+    std::mutex               model_lock;
+    Byte_Ring                input;
+    Log_Queue                log_queue;
+    std::vector<std::string> passthrough;
+    std::vector<Row_Op>      row_ops;
+    Term_Stats               stats;
+    FILE                    *record          = NULL;
+    u64                      record_start    = 0;
+    std::thread              replay_thr;
+    std::atomic<int>         replay_stop;
+    std::mutex               out_lock;
+    std::string              out;
+    size_t                   out_off         = 0;
+    int                      poll_fd         = -1;
+    int                      poll_events     = 0;
+    int                      max_block_size  = 0;
+    size_t                   min_read_size   = 0;
+    size_t                   read_size       = 0;
+    int                      delay_update    = 0;
+    std::atomic<int>         frame_ms        { 0 };
+    std::atomic<size_t>      high_water      { 0 };
+    std::atomic<int>         fast_forward    { 0 };
+    std::atomic<int>         visible         { 0 };
+    std::atomic<int>         flush_pending   { 0 };
+    size_t                   backlog         = 0;
+    int                      reading_paused  = 0;
+    int                      flooding        = 0;
+    u64                      last_read       = 0;
+    u64                      last_flush      = 0;
+    u64                      sync_start      = 0;
+    u64                      last_wake       = 0;
+    int                      wake_deferred   = 0;
+    yed_buffer              *buffer          = NULL;
+    int                      materialized    = 0;
+    int                      buffer_top      = 0;
+    yed_attrs                current_attrs   = ZERO_ATTR;
+    Screen                   main_screen;
+    Screen                   alt_screen;
+    Screen                  *_screen         = NULL;
+    int                      app_keys        = 0;
+    int                      auto_wrap       = 1;
+    int                      wrap_next       = 0;
+    std::string              title;
+    std::atomic<int>         term_mode       { 1 };
+    std::string              command;
+    Parser                   parser;
+
+    /* Caller holds out_lock. */
+    void set_poll_events(int events) {
+        if (this->poll_fd < 0) { return; }
+
+        poll_set(this->poll_fd, this->master_fd, this, this->poll_events, events);
+        this->poll_events = events;
+    }
+
+    /* Caller holds out_lock. */
+    void update_poll_events() {
+        this->set_poll_events((this->reading_paused ? 0 : POLL_READ)
+                              | (this->out_off < this->out.size() ? POLL_WRITE : 0));
+    }
+
+    /*
+     * While reading is paused, output waits in the pty, and once that fills up the
+     * kernel blocks the child's writes.
+     * Only update() resumes reading, and it doesn't run with term mode off, so
+     * reading isn't paused then. term_mode is checked under out_lock, which
+     * toggle_term_mode() also takes to resume reading after clearing it.
+     */
+    void pause_reading(int pause) {
+        std::lock_guard<std::mutex> lock(this->out_lock);
+
+        if (pause && !this->term_mode)     { return; }
+        if (pause == this->reading_paused) { return; }
+
+        this->reading_paused = pause;
+        this->update_poll_events();
+    }
+
+    /*
+     * Everything bound for the child goes through here. Whatever the pty won't take
+     * right now is queued, in order, and the I/O loop drains it as the fd becomes
+     * writable again.
+     */
+    void sendv(const struct iovec *iov, int n_iov) {
+        std::lock_guard<std::mutex> lock(this->out_lock);
+        ssize_t                     n = 0;
+
+        if (this->out_off == this->out.size()) {
+            n = writev(this->master_fd, iov, n_iov);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    errno = 0;
+                    return;
                 }
+                errno = 0;
+                n     = 0;
+            }
+        }
+
+        for (int i = 0; i < n_iov; i += 1) {
+            if ((size_t)n >= iov[i].iov_len) {
+                n -= iov[i].iov_len;
                 continue;
             }
 
-            /* The main thread has signaled us to stop. */
-            if (pfds[1].revents & POLLIN) { return; }
+            this->out.append((const char*)iov[i].iov_base + n, iov[i].iov_len - n);
+            n = 0;
+        }
 
-            int max          = term->max_block_size;
-            int force_update = 0;
+        if (this->out_off < this->out.size()) {
+            this->update_poll_events();
+        }
+    }
 
-            { std::lock_guard<std::mutex> lock(term->buff_lock);
-                auto s  = term->data_buff.size();
+    void send(const char *bytes, size_t len) {
+        struct iovec iov;
 
-                /* If the main thread has emptied the buffer, we need
-                 * to force a new update for this new data. */
-                force_update = s == 0;
+        iov.iov_base = (void*)bytes;
+        iov.iov_len  = len;
+        this->sendv(&iov, 1);
+    }
 
-                term->data_buff.resize(s + term->read_chunk_size);
-                char *p = &(term->data_buff[term->data_buff.size() - term->read_chunk_size]);
+    void send(const std::string &s) { this->send(s.data(), s.size()); }
 
-                while ((n = read(term->master_fd, p, term->read_chunk_size)) > 0) {
-                    term->data_buff.resize(((p + n) - term->data_buff.data()) + term->read_chunk_size);
-                    p = &(term->data_buff[term->data_buff.size() - term->read_chunk_size]);
+    /* Called by the I/O loop when master_fd is writable. */
+    void drain() {
+        std::lock_guard<std::mutex> lock(this->out_lock);
+        ssize_t                     n;
 
-                    if (term->data_buff.size() > max) {
-                        force_update = 1;
-                        break;
+        while (this->out_off < this->out.size()) {
+            n = write(this->master_fd,
+                      this->out.data() + this->out_off,
+                      MIN(this->out.size() - this->out_off, (size_t)MAX_WRITE_SIZE));
+            if (n <= 0) {
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    errno = 0;
+                    if (this->out_off >= this->out.size() / 2) {
+                        this->out.erase(0, this->out_off);
+                        this->out_off = 0;
                     }
+                    return;
                 }
+                errno = 0;
+                break;
+            }
+            this->out_off += n;
+        }
+
+        this->out.clear();
+        this->out_off = 0;
+        this->update_poll_events();
+    }
+
+    /* Starts teeing everything read from the child into path. Caller holds model_lock. */
+    int start_recording(const char *path) {
+        FILE *f;
+
+        if ((f = fopen(path, "wb")) == NULL) {
+            errno = 0;
+            return 0;
+        }
+
+        fputs(RECORDING_MAGIC, f);
+
+        this->stop_recording();
+        this->record       = f;
+        this->record_start = measure_time_now_ms();
+
+        return 1;
+    }
+
+    void stop_recording() {
+        if (this->record != NULL) {
+            fclose(this->record);
+            this->record = NULL;
+        }
+    }
+
+    /*
+     * Feeds a recording on its own thread, at full speed or at the pace it was
+     * recorded at. The editor is woken at most once a frame, like the I/O loop.
+     */
+    void replay(std::vector<Recorded_Read> &&reads, int realtime) {
+        this->replay_thr = std::thread(Term::replay_main, this, std::move(reads), realtime);
+    }
+
+    void stop_replay() {
+        if (this->replay_thr.joinable()) {
+            this->replay_stop = 1;
+            this->replay_thr.join();
+        }
+    }
+
+    static void replay_main(Term *t, std::vector<Recorded_Read> reads, int realtime) {
+        u64 start     = measure_time_now_ms();
+        u64 last_wake = 0;
+        u64 now;
+
+        thread_log_queue = &t->log_queue;
+
+        for (auto &r : reads) {
+            while (realtime && !t->replay_stop && (now = measure_time_now_ms()) - start < r.ms) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(MIN(r.ms - (now - start), (u64)10)));
+            }
+            if (t->replay_stop) { break; }
+
+            for (size_t off = 0; off < r.bytes.size(); off += t->max_block_size) {
+                std::lock_guard<std::mutex> lock(t->model_lock);
+                size_t                      len = MIN(r.bytes.size() - off, (size_t)t->max_block_size);
+
+                t->feed(r.bytes.data() + off, len);
+                if (t->parser.do_log) { t->dump_debug(); }
+                t->stats.bytes_read += len;
+                t->flush_pending     = 1;
+            }
+
+            now = measure_time_now_ms();
+            if (now - last_wake >= (u64)MAX(t->frame_ms.load(), 1)) {
+                yed_force_update();
+                last_wake = now;
+            }
+        }
+
+        thread_log_queue = NULL;
+
+        yed_force_update();
+    }
 
-                term->data_buff.resize((p - term->data_buff.data()));
+    /*
+     * Sizes reads after what the child has pending: doubling up to MAX_READ_SIZE
+     * while a producer is streaming, halving back toward min_read_size as it goes
+     * quiet. The input ring follows along whenever it is empty.
+     */
+    void adapt_read_size(size_t avail) {
+        if (avail > this->read_size) {
+            while (this->read_size < avail && this->read_size < MAX_READ_SIZE) {
+                this->read_size <<= 1;
             }
+        } else if (avail < this->read_size / 4 && this->read_size > this->min_read_size) {
+            this->read_size = MAX(this->read_size >> 1, this->min_read_size);
+        }
+
+        if (this->input.size() == 0
+        &&  (this->input.capacity() < this->read_size
+        ||   this->input.capacity() > 4 * this->read_size)) {
+
+            this->input.reserve(this->read_size);
+        }
+    }
+
+    /*
+     * Called by the I/O loop when master_fd is readable. Reads everything the child
+     * has pending (per FIONREAD), up to read_size, into the input ring and parses it
+     * from there in place, max_block_size bytes per hold of model_lock.
+     * Returns -1 once the child's side is gone.
+     */
+    int service() {
+        ssize_t n;
+        size_t  len;
+        size_t  want;
+        size_t  got    = 0;
+        size_t  parsed = 0;
+        int     reads  = 0;
+        int     eof    = 0;
+        int     avail  = 0;
+        int     pause  = 0;
+
+        if (ioctl(this->master_fd, FIONREAD, &avail) < 0) {
+            errno = 0;
+            avail = 0;
+        }
 
+        this->adapt_read_size(avail);
+
+        want = avail > 0 ? MIN((size_t)avail, this->read_size) : this->read_size;
+
+        while (got < want) {
+            char *p = this->input.write_span(&len);
+            if (len == 0) { break; }
+
+            n = read(this->master_fd, p, MIN(len, want - got));
+            reads += 1;
             if (n <= 0) {
-                if (errno == EWOULDBLOCK) {
+                if (n < 0 && (errno == EWOULDBLOCK || errno == EINTR)) {
                     errno = 0;
                 } else {
-                    errno                = 0;
-                    term->process_exited = 1;
-                    return;
+                    errno = 0;
+                    eof   = 1;
+                }
+                break;
+            }
+
+            this->input.commit(n);
+            got += n;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(this->model_lock);
+
+            this->stats.bytes_read  += got;
+            this->stats.reads       += reads;
+            this->stats.input_depth  = this->input.size();
+            this->stats.input_peak   = MAX(this->stats.input_peak, this->stats.input_depth);
+
+            /* Reads grow past their minimum only while the child is writing faster than that. */
+            this->flooding = this->read_size > this->min_read_size;
+            if (got > 0) { this->last_read = measure_time_now_ms(); }
+
+            if (this->record != NULL && got > 0) {
+                fprintf(this->record, "%llu %zu\n",
+                        (unsigned long long)(measure_time_now_ms() - this->record_start), got);
+                for (size_t off = 0; off < got; off += len) {
+                    const char *p = this->input.read_span(&len, off);
+                    fwrite(p, 1, len, this->record);
                 }
             }
+        }
+
+        thread_log_queue = &this->log_queue;
 
-            if (force_update && !term->update_waiting) { yed_force_update(); }
+        while (this->input.size() > 0) {
+            std::lock_guard<std::mutex> lock(this->model_lock);
+
+            const char *p = this->input.read_span(&len);
+            len = MIN(len, (size_t)this->max_block_size);
+
+            this->feed(p, len);
+            this->input.consume(len);
+            if (this->parser.do_log) { this->dump_debug(); }
+            this->flush_pending  = 1;
+            this->backlog       += len;
+
+            parsed += len;
+
+            /* Stop reading once the editor is too far from drawing what has been read. */
+            if (!pause
+            &&  this->high_water > 0
+            &&  this->backlog >= this->high_water
+            &&  this->visible
+            &&  this->term_mode
+            &&  !this->fast_forward) {
+
+                pause                    = 1;
+                this->stats.read_pauses += 1;
+            }
         }
+
+        thread_log_queue = NULL;
+
+        if (pause) { this->pause_reading(1); }
+
+        /* A terminal that isn't in any frame is parsed but never woken for. */
+        if (parsed > 0 && this->visible) { this->wake_deferred = 1; }
+
+        return eof ? -1 : 0;
+    }
+
+    /*
+     * Wakes of the main thread are limited to one per frame_ms. Returns how long the
+     * I/O loop may sleep before this terminal wants one, or -1 if it doesn't.
+     * Runs on the I/O thread without model_lock, so what it reads of the main
+     * thread's state is atomic.
+     */
+    int wake_timeout(u64 now) {
+        /* update() doesn't flush with term mode off, so a pending flush would only keep waking it for nothing. */
+        if (!this->wake_deferred && !(this->flush_pending && this->visible && this->term_mode)) { return -1; }
+
+        u64 due = this->last_wake + MAX(this->frame_ms.load(), 1);
+
+        /* There's nothing to draw until a synchronized update ends or times out. */
+        if (this->sync_start) { due = MAX(due, this->sync_start + SYNC_TIMEOUT_MS); }
+
+        return due > now ? (int)(due - now) : 0;
     }
 
     Screen& screen() { return *this->_screen; }
 
+    /* Once the reader thread is running, the caller must hold model_lock. */
     void resize(int width, int height) {
         struct winsize ws;
 
@@ -776,127 +2848,392 @@ struct Term {
         ws.ws_xpixel = 0;
         ws.ws_ypixel = 0;
 
-        if (ioctl(this->slave_fd, TIOCSWINSZ, &ws) == -1) {
+        if (this->slave_fd >= 0 && ioctl(this->slave_fd, TIOCSWINSZ, &ws) == -1) {
             ELOG("ioctl(TIOCSWINSZ) failed with errno = %d", errno);
             return;
         }
 
-        { BUFF_WRITABLE_GUARD(this->buffer);
-            int n_rows = this->screen().scrollback + height;
+        if (this->materialized) {
+            this->screen().apply_row_ops(this->buffer);
+        } else {
+            this->row_ops.clear();
+        }
+
+        /* A wrap that is still pending moves with the text to wherever the next character goes. */
+        if (this->wrap_next && this->screen().reflows && width != this->width()) {
+            this->screen().cursor_col += 1;
+            this->wrap_next = 0;
+        }
+
+        /* The other screen catches up when it is switched to. */
+        int cut_top;
+        int cut_bottom;
+        this->screen().set_dimensions(width, height, &cut_top, &cut_bottom);
+
+        /* Do to the buffer exactly what reshape() or reflow() did to the screen's rows. */
+        if (this->materialized) { BUFF_WRITABLE_GUARD(this->buffer);
+            int n_rows = this->screen().scrollback + height - this->buffer_top;
+            int top    = MAX(this->screen().base() + 1 - this->buffer_top, 1);
+
+            for (int i = 0; i < cut_top; i += 1) {
+                yed_buff_delete_line_no_undo(this->buffer, top);
+            }
+            for (int i = cut_top; i < 0; i += 1) {
+                yed_buff_insert_line_no_undo(this->buffer, top);
+            }
+            for (int i = 0; i < cut_bottom; i += 1) {
+                yed_buff_delete_line_no_undo(this->buffer, yed_buff_n_lines(this->buffer));
+            }
+            while (yed_buff_n_lines(this->buffer) < n_rows) {
+                yed_buffer_add_line_no_undo(this->buffer);
+            }
+        }
+
+        ASSERT(!this->materialized || yed_buff_n_lines(this->buffer) == this->screen().scrollback + height - this->buffer_top,
+               "buff wrong size");
+
+        DBG("new size %dx%d", width, height);
+
+        this->delay_update = 1;
+    }
+
+
+    /* cmd is the program to run and its arguments, or empty for the shell. */
+    Term(u32 num, const std::vector<std::string> &cmd) : replay_stop(0),
+                                                         main_screen(this->current_attrs, this->row_ops, this->buffer_top),
+                                                         alt_screen(this->current_attrs, this->row_ops, this->buffer_top),
+                                                         _screen(&this->main_screen) {
+
+        char           name[64];
+        struct winsize ws;
+
+        this->master_fd = -1;
+        this->slave_fd  = -1;
+
+        snprintf(name, sizeof(name), "*term%u", num);
+        this->buffer = yed_get_or_create_special_rdonly_buffer(name);
+
+        ws.ws_row    = DEFAULT_HEIGHT;
+        ws.ws_col    = DEFAULT_WIDTH;
+        ws.ws_xpixel = 0;
+        ws.ws_ypixel = 0;
+
+        if (openpty(&this->master_fd, &this->slave_fd, NULL, NULL, &ws) != 0) {
+            ELOG("openpty() failed with errno = %d", errno);
+            errno = 0;
+            return;
+        }
+
+        /* Children of other terminals shouldn't hold this pty open. */
+        fcntl(this->master_fd, F_SETFD, FD_CLOEXEC);
+        fcntl(this->slave_fd,  F_SETFD, FD_CLOEXEC);
+
+        std::vector<std::string> args = cmd;
+        if (args.empty()) { args.push_back(get_shell()); }
+
+        this->command = args[0];
+
+        if (!this->spawn(args)) {
+            this->process_exited = 1;
+            this->bad_shell      = 1;
+        }
+
+        int flags = fcntl(this->master_fd, F_GETFL);
+        int err = fcntl(this->master_fd, F_SETFL, flags | O_NONBLOCK);
+        (void)err;
+
+        this->init_model();
+
+        if (cmd.empty() && yed_var_is_truthy("terminal-show-welcome")) {
+            const char *welcome =
+"Welcome to\r\n"
+TERM_CYAN
+"                _   _                      _             _ \r\n"
+" _   _  ___  __| | | |_ ___ _ __ _ __ ___ (_)_ __   __ _| |\r\n"
+"| | | |/ _ \\/ _` | | __/ _ \\ '__| '_ ` _ \\| | '_ \\ / _` | |\r\n"
+"| |_| |  __/ (_| | | ||  __/ |  | | | | | | | | | | (_| | |\r\n"
+" \\__, |\\___|\\__,_|  \\__\\___|_|  |_| |_| |_|_|_| |_|\\__,_|_|\r\n"
+" |___/  \r\n\r\n" TERM_RESET;
+
+            this->feed(welcome, strlen(welcome));
+        }
+    }
+
+    /*
+     * Nothing can run in the child between fork and exec with posix_spawn, so argv
+     * and the environment are built here first. posix_spawn doesn't copy the editor's
+     * page tables the way fork() does, which would make opening a terminal cost more
+     * the more buffers are loaded. The child is made a session leader and then opens
+     * its pty, which makes that its controlling terminal.
+     * Returns 0 if the child couldn't be started.
+     */
+    int spawn(const std::vector<std::string> &args) {
+        std::vector<std::string> env;
+        std::vector<char*>       argv;
+        std::vector<char*>       envp;
+
+        for (char **e = environ; *e != NULL; e += 1) {
+            if (strncmp(*e, "TERM=", 5) != 0) { env.push_back(*e); }
+        }
+        env.push_back(std::string("TERM=") + get_termvar());
+
+        for (auto &arg : args) { argv.push_back((char*)arg.c_str()); }
+        argv.push_back(NULL);
+        for (auto &var : env) { envp.push_back((char*)var.c_str()); }
+        envp.push_back(NULL);
+
+#ifdef USE_POSIX_SPAWN
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t          attr;
+        sigset_t                   sigs;
+        char                       tty[256];
+        int                        err;
+
+        if ((err = ttyname_r(this->slave_fd, tty, sizeof(tty))) != 0) {
+            ELOG("ttyname_r() failed with error %d", err);
+            return 0;
+        }
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 0, tty, O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, 0, 1);
+        posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+        posix_spawnattr_init(&attr);
+        sigemptyset(&sigs);
+        posix_spawnattr_setsigmask(&attr, &sigs);
+        sigfillset(&sigs);
+        sigdelset(&sigs, SIGKILL);
+        sigdelset(&sigs, SIGSTOP);
+        posix_spawnattr_setsigdefault(&attr, &sigs);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+        err = posix_spawnp(&this->shell_pid, argv[0], &actions, &attr, argv.data(), envp.data());
+
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        if (err != 0) {
+            ELOG("failed to start '%s' with error %d", argv[0], err);
+            this->shell_pid = 0;
+            return 0;
+        }
+#else
+        pid_t p = fork();
+        if (p == 0) {
+            close(this->master_fd);
+            login_tty(this->slave_fd);
 
-            if (yed_buff_n_lines(this->buffer) < n_rows) {
-                while (yed_buff_n_lines(this->buffer) < n_rows) {
-                    yed_buffer_add_line_no_undo(this->buffer);
-                }
-            } else while (yed_buff_n_lines(this->buffer) > n_rows) {
-                auto linep = this->screen().lines.back();
-                auto &line = *linep;
+            environ = envp.data();
+            execvp(argv[0], argv.data());
+            exit(123);
+        }
 
-                if (line[0].glyph.c == 0) {
-                    yed_buff_delete_line_no_undo(this->buffer, yed_buff_n_lines(this->buffer));
-                } else {
-                    yed_buff_delete_line_no_undo(this->buffer, 1);
-                }
-            }
+        if (p < 0) {
+            ELOG("fork() failed with errno = %d", errno);
+            errno = 0;
+            return 0;
         }
 
-        this->main_screen.set_dimensions(width, height, this->buffer);
-        this->alt_screen.set_dimensions(width, height, this->buffer);
+        this->shell_pid = p;
+#endif
 
-        ASSERT(yed_buff_n_lines(this->buffer) == this->screen().scrollback + height,
-               "buff wrong size");
+        return 1;
+    }
 
-        DBG("new size %dx%d", width, height);
+    /*
+     * A terminal with no child process behind it. Its output is whatever gets
+     * fed to it, e.g. a capture for term-bench or a term-replay recording.
+     */
+    Term(const char *name) : replay_stop(0),
+                             main_screen(this->current_attrs, this->row_ops, this->buffer_top),
+                             alt_screen(this->current_attrs, this->row_ops, this->buffer_top),
+                             _screen(&this->main_screen) {
 
-        this->delay_update = 1;
-    }
+        this->master_fd = -1;
+        this->slave_fd  = -1;
+        this->buffer    = yed_get_or_create_special_rdonly_buffer((char*)name);
 
+        this->init_model();
+    }
 
-    Term(u32 num) : main_screen(this->current_attrs),
-                    alt_screen(this->current_attrs),
-                    _screen(&this->main_screen) {
+    /*
+     * Picks a terminal back up from what save() wrote before the plugin was reloaded.
+     * The buffer still shows what the model did then, so nothing is rewritten.
+     */
+    Term(Snapshot &snap) : replay_stop(0),
+                           main_screen(this->current_attrs, this->row_ops, this->buffer_top),
+                           alt_screen(this->current_attrs, this->row_ops, this->buffer_top),
+                           _screen(&this->main_screen) {
+
+        std::string name;
+        std::string pending;
+        u64         n_passthrough;
+        int         alt;
+        int         term_mode;
+        int         process_exited;
+        size_t      len;
+
+        this->master_fd = -1;
+        this->slave_fd  = -1;
+
+        snap.get(this->shell_pid);
+        snap.get(process_exited);
+        this->process_exited = process_exited;
+        snap.get(this->bad_shell);
+        snap.get(this->command);
+        snap.get(name);
+        snap.get(this->materialized);
+        snap.get(this->buffer_top);
+        snap.get(this->current_attrs);
+        snap.get(alt);
+        snap.get(this->app_keys);
+        snap.get(this->auto_wrap);
+        snap.get(this->wrap_next);
+        snap.get(this->title);
+        snap.get(term_mode);
+        this->term_mode = term_mode;
+        snap.get(this->sync_start);
+        snap.get(this->stats);
+        snap.get(this->row_ops);
+        snap.get(pending);
+        snap.get(this->out);
+        snap.get(n_passthrough);
+        for (u64 i = 0; i < n_passthrough && !snap.bad; i += 1) {
+            this->passthrough.emplace_back();
+            snap.get(this->passthrough.back());
+        }
+        this->parser.load(snap);
+        this->main_screen.load(snap);
+        this->alt_screen.load(snap);
 
-        char           name[64];
-        pid_t          p;
-        struct winsize ws;
+        if (snap.bad) { return; }
 
-        snprintf(name, sizeof(name), "*term%u", num);
-        this->buffer = yed_get_or_create_special_rdonly_buffer(name);
+        /* The fds go last, so that a bad snapshot never leaves this terminal owning them. */
+        snap.get(this->master_fd);
+        snap.get(this->slave_fd);
 
-        ws.ws_row    = DEFAULT_HEIGHT;
-        ws.ws_col    = DEFAULT_WIDTH;
-        ws.ws_xpixel = 0;
-        ws.ws_ypixel = 0;
+        if (alt) { this->_screen = &this->alt_screen; }
 
-        if (pipe(this->sig_fds) != 0) {
-            ELOG("pipe() failed with errno = %d", errno);
-            errno = 0;
-            return;
+        /* Buffers are the editor's, so they are still there unless someone deleted one. */
+        if ((this->buffer = yed_get_buffer((char*)name.c_str())) == NULL) {
+            this->buffer       = yed_get_or_create_special_rdonly_buffer((char*)name.c_str());
+            this->materialized = 0;
+            this->buffer_top   = 0;
         }
 
-        if (openpty(&this->master_fd, &this->slave_fd, NULL, NULL, &ws) != 0) {
-            ELOG("openpty() failed with errno = %d", errno);
-            errno = 0;
-            return;
-        }
+        this->init_reads();
 
-        int print_welcome = yed_var_is_truthy("terminal-show-welcome");
+        if (this->input.capacity() < pending.size()) { this->input.reserve(pending.size()); }
+        memcpy(this->input.write_span(&len), pending.data(), pending.size());
+        this->input.commit(pending.size());
 
-        p = fork();
-        if (p == 0) {
-            close(this->master_fd);
-            login_tty(this->slave_fd);
+        this->flush_pending = 1;
+        this->valid         = 1;
+    }
 
-            setenv("TERM", get_termvar(), 1);
+    /* Caller holds model_lock, and nothing else may be running on this terminal. */
+    void save(Snapshot &snap) {
+        std::string pending;
+        size_t      len;
 
-            if (print_welcome) {
-            printf(
-"Welcome to\n"
-TERM_CYAN
-"                _   _                      _             _ \n"
-" _   _  ___  __| | | |_ ___ _ __ _ __ ___ (_)_ __   __ _| |\n"
-"| | | |/ _ \\/ _` | | __/ _ \\ '__| '_ ` _ \\| | '_ \\ / _` | |\n"
-"| |_| |  __/ (_| | | ||  __/ |  | | | | | | | | | | (_| | |\n"
-" \\__, |\\___|\\__,_|  \\__\\___|_|  |_| |_| |_|_|_| |_|\\__,_|_|\n"
-" |___/  \n\n" TERM_RESET);
-            }
+        for (size_t off = 0; off < this->input.size(); off += len) {
+            const char *p = this->input.read_span(&len, off);
+            pending.append(p, len);
+        }
 
-            char * const args[] = { (char*)get_shell(), NULL };
-            execvp(get_shell(), args);
-            exit(123);
-        } else {
-            int flags = fcntl(this->master_fd, F_GETFL);
-            int err = fcntl(this->master_fd, F_SETFL, flags | O_NONBLOCK);
-            (void)err;
+        snap.put(this->shell_pid);
+        snap.put(this->process_exited.load());
+        snap.put(this->bad_shell);
+        snap.put(this->command);
+        snap.put(std::string(this->buffer->name));
+        snap.put(this->materialized);
+        snap.put(this->buffer_top);
+        snap.put(this->current_attrs);
+        snap.put((int)(this->_screen == &this->alt_screen));
+        snap.put(this->app_keys);
+        snap.put(this->auto_wrap);
+        snap.put(this->wrap_next);
+        snap.put(this->title);
+        snap.put(this->term_mode.load());
+        snap.put(this->sync_start);
+        snap.put(this->stats);
+        snap.put(this->row_ops);
+        snap.put(pending);
+        snap.put(this->out.substr(this->out_off));
+        snap.put((u64)this->passthrough.size());
+        for (auto &str : this->passthrough) { snap.put(str); }
+        this->parser.save(snap);
+        this->main_screen.save(snap);
+        this->alt_screen.save(snap);
+        snap.put(this->master_fd);
+        snap.put(this->slave_fd);
+    }
+
+    /* Leaves the child, its pty and the buffer to the terminal restored from a snapshot of this one. */
+    void hand_over() {
+        this->master_fd = -1;
+        this->slave_fd  = -1;
+        this->buffer    = NULL;
+    }
 
-            this->shell_pid = p;
+    void init_model() {
+        /* Programs on the alternate screen redraw for the new size themselves. */
+        this->main_screen.reflows = 1;
+        this->alt_screen.drop_history();
 
-            this->resize(DEFAULT_WIDTH, DEFAULT_HEIGHT);
-            this->set_cursor(1, 1);
+        this->resize(DEFAULT_WIDTH, DEFAULT_HEIGHT);
+        this->set_cursor(1, 1);
 
-            this->max_block_size  = get_max_block_size();
-            this->read_chunk_size = get_read_chunk_size();
+        this->init_reads();
 
-            thr = std::thread(Term::read_thread, this);
+        this->valid = 1;
+    }
 
-            this->valid = 1;
-        }
+    void init_reads() {
+        this->max_block_size  = MAX(get_max_block_size(), 1);
+        this->min_read_size   = MIN((size_t)MAX(get_read_chunk_size(), 1), (size_t)MAX_READ_SIZE);
+        this->read_size       = this->min_read_size;
+        this->input.reserve(this->read_size);
     }
 
+    /* The I/O loop must have let go of this terminal already. */
     ~Term() {
-        char z = 0;
+        this->stop_replay();
+        this->stop_recording();
+
+        if (this->buffer != NULL) { this->publish_stats(1); }
 
-        write(this->sig_fds[1], &z, 1);
+        if (this->master_fd >= 0) { close(this->master_fd); }
+        if (this->slave_fd >= 0)  { close(this->slave_fd);  }
 
-        close(this->master_fd);
-        close(this->slave_fd);
+        if (this->buffer != NULL) { yed_free_buffer(this->buffer); }
+    }
 
-        thr.join();
+    /*
+     * Both screens end in the same viewport rows of the buffer, so switching only has
+     * to rewrite those. The main screen's scrollback above them is left as it is,
+     * unless the main screen was resized while it was hidden.
+     */
+    void switch_screen(Screen *s) {
+        int width  = this->width();
+        int height = this->height();
+
+        if (this->materialized) {
+            this->screen().apply_row_ops(this->buffer);
+        } else {
+            this->row_ops.clear();
+        }
 
-        close(this->sig_fds[1]);
-        close(this->sig_fds[0]);
+        /* Screens are only resized while they're shown, so the one switched to may need to catch up. */
+        if (s->width != width || s->height != height) {
+            s->set_dimensions(width, height);
+            s->make_dirty();
+        } else {
+            s->make_viewport_dirty();
+        }
 
-        yed_free_buffer(this->buffer);
+        this->_screen = s;
     }
 
     void move_cursor(int rows, int cols, int cancel_wrap = 1) {
@@ -933,6 +3270,7 @@ TERM_CYAN
         this->app_keys      = 0;
         this->auto_wrap     = 1;
         this->wrap_next     = 0;
+        this->sync_start    = 0;
 
         this->set_scroll(0, 0);
         this->set_cursor(1, 1);
@@ -959,17 +3297,150 @@ TERM_CYAN
         this->delete_cell(this->row(), this->col());
     }
 
-    void scroll_up()          { this->screen().scroll_up(this->buffer);        }
-    void scroll_down()        { this->screen().scroll_down(this->buffer);      }
-    void insert_line(int row) { this->screen().insert_line(row, this->buffer); }
-    void delete_line(int row) { this->screen().delete_line(row, this->buffer); }
+    void scroll_up()          { this->screen().scroll_up();   this->stats.lines_scrolled += 1; }
+    void scroll_down()        { this->screen().scroll_down(); this->stats.lines_scrolled += 1; }
+    void insert_line(int row) { this->screen().insert_line(row); }
+    void delete_line(int row) { this->screen().delete_line(row); }
 
     void set_cursor_in_frame(yed_frame *frame) {
-        yed_set_cursor_within_frame(frame, this->scrollback_row() + this->height() - (this->height() <= 1), this->col());
-        yed_set_cursor_within_frame(frame, this->scrollback_row(), this->col());
+        int row = this->scrollback_row() - this->buffer_top;
+
+        yed_set_cursor_within_frame(frame, row + this->height() - (this->height() <= 1), this->col());
+        yed_set_cursor_within_frame(frame, row, this->col());
+    }
+
+    /*
+     * A terminal's buffer is left empty until it is first written, so terminals
+     * that are never looked at cost no more than their model.
+     */
+    void materialize() {
+        BUFF_WRITABLE_GUARD(this->buffer);
+
+        this->buffer_top = this->term_mode ? this->screen().scrollback : 0;
+
+        while (yed_buff_n_lines(this->buffer) < this->screen().scrollback + this->height() - this->buffer_top) {
+            yed_buffer_add_line_no_undo(this->buffer);
+        }
+
+        this->row_ops.clear();
+        this->main_screen.make_used_dirty();
+        if (&this->screen() == &this->alt_screen) { this->alt_screen.make_used_dirty(); }
+
+        this->materialized = 1;
+    }
+
+    /* first_row is a row of the buffer as it is. */
+    void write_to_buffer(int first_row = 1) {
+        u64 start = measure_time_now_ns();
+
+        if (!this->materialized) { this->materialize(); }
+
+        first_row += this->buffer_top;
+
+        this->stats.lines_flushed += this->screen().write_to_buffer(this->buffer, first_row);
+        if (&this->screen() == &this->alt_screen) {
+            /* The main screen's scrollback is still shown above the alternate screen. */
+            this->stats.lines_flushed += this->main_screen.write_to_buffer(this->buffer, first_row, this->alt_screen.base());
+        }
+        this->stats.flushes       += 1;
+        this->stats.flush_ns      += measure_time_now_ns() - start;
+    }
+
+    /*
+     * Writes the rows in [first_row, last_row] of the buffer that are behind the model,
+     * in place. This is how the scrollback is filled in with term mode off, as frames
+     * reach it: rows are only written once something looks at them. Caller holds model_lock.
+     */
+    void fill(int first_row, int last_row) {
+        int n_written = 0;
+
+        if (!this->materialized) { this->materialize(); }
+
+        BUFF_WRITABLE_GUARD(this->buffer);
+
+        yed_line new_line = yed_new_line_with_cap(this->width());
+
+        LIMIT(first_row, 1, yed_buff_n_lines(this->buffer) + 1);
+        LIMIT(last_row, 0, yed_buff_n_lines(this->buffer));
+
+        for (int row = first_row; row <= last_row; row += 1) {
+            int model_row = this->screen().model_row(row);
+
+            if (model_row < 1) { continue; }
+
+            n_written += this->screen_of(model_row).fill_row(this->buffer, row + this->buffer_top, model_row, new_line);
+        }
+
+        yed_free_line(&new_line);
+
+        if (n_written) {
+            this->main_screen.tidy_dirty();
+            this->alt_screen.tidy_dirty();
+        }
+
+        this->stats.lines_flushed += n_written;
+    }
+
+    void fill_row(int row) {
+        std::lock_guard<std::mutex> lock(this->model_lock);
+        this->fill(row, row);
+    }
+
+    /* Replays the row moves that the buffer hasn't seen yet, without writing any text. Caller holds model_lock. */
+    void catch_up_rows() {
+        if (!this->materialized) { this->materialize(); }
+        this->screen().apply_row_ops(this->buffer);
+    }
+
+    /* Fills in the rows that frames showing this terminal have in view. */
+    void fill_frames() {
+        yed_frame **it;
+
+        std::lock_guard<std::mutex> lock(this->model_lock);
+
+        array_traverse(ys->frames, it) {
+            yed_frame *f = *it;
+
+            if (f->buffer != this->buffer) { continue; }
+
+            this->fill(f->buffer_y_offset + 1, f->buffer_y_offset + f->height);
+        }
     }
 
-    void write_to_buffer() { this->screen().write_to_buffer(this->buffer); }
+    /*
+     * In term mode, nothing can scroll the buffer away from the screen rows, so that is
+     * all it holds. Turning term mode off gives it rows for the scrollback again, which
+     * are filled in as frames reach them. Caller holds model_lock.
+     */
+    void fit_buffer_to_mode() {
+        int top = this->term_mode ? this->screen().scrollback : 0;
+
+        if (!this->materialized || top == this->buffer_top) { return; }
+
+        BUFF_WRITABLE_GUARD(this->buffer);
+
+        /* Every row that stays ends up showing a different line, so the queued moves don't matter. */
+        this->row_ops.clear();
+
+        if (top) {
+            while (yed_buff_n_lines(this->buffer) > this->height()) {
+                yed_buff_delete_line_no_undo(this->buffer, yed_buff_n_lines(this->buffer));
+            }
+            this->screen().make_viewport_dirty();
+        } else {
+            /* Rather than show the screen twice until they're filled, the old rows start out empty. */
+            for (int row = 1; row <= yed_buff_n_lines(this->buffer); row += 1) {
+                yed_line_clear_no_undo(this->buffer, row);
+            }
+            while (yed_buff_n_lines(this->buffer) < this->screen().scrollback + this->height()) {
+                yed_buffer_add_line_no_undo(this->buffer);
+            }
+            this->main_screen.make_dirty();
+            if (&this->screen() == &this->alt_screen) { this->alt_screen.make_dirty(); }
+        }
+
+        this->buffer_top = top;
+    }
 
     void execute_CSI(CSI &csi) {
         long val;
@@ -979,22 +3450,15 @@ TERM_CYAN
 #define PRIV(_cmd)       ENC((_cmd), MODE_PRIV)
 #define XTERM(_cmd)      ENC((_cmd), MODE_XTERM)
 
-#define SHIFT()                           \
-do {                                      \
-    if (csi.args.size()) {                \
-        csi.args.erase(csi.args.begin()); \
-    }                                     \
-} while (0)
-
         /* Resources:
          *     https://invisible-island.net/xterm/ctlseqs/ctlseqs.html
          *     https://vt100.net/docs
          *     http://www.xfree86.org/4.5.0/ctlseqs.html
          */
 
-        switch (ENC(csi.command, csi.mode)) {
+        switch (ENC(csi.command, csi.mode) | (csi.intermediate << 16)) {
             case '@': {
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
 
                 auto save = this->current_attrs;
                 this->current_attrs = ZERO_ATTR;
@@ -1005,48 +3469,48 @@ do {                                      \
                 break;
             }
             case 'A':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->move_cursor(-val, 0);
                 break;
             case 'B':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->move_cursor(val, 0);
                 break;
             case 'c': {
                 const char *id = "\e[?6c";
-                write(this->master_fd, id, strlen(id));
+                this->send(id, strlen(id));
                 break;
             }
             case XTERM('c'): { /* Send device attributes. */
                 const char *id = "\e[>0;0;0c";
-                write(this->master_fd, id, strlen(id));
+                this->send(id, strlen(id));
                 break;
             }
             case 'C':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->move_cursor(0, val);
                 break;
             case 'D':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->move_cursor(0, -val);
                 break;
             case 'E':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->move_cursor(val, 0);
                 this->set_cursor(this->row(), 1);
                 break;
             case 'F':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->move_cursor(-val, 0);
                 this->set_cursor(this->row(), 1);
                 break;
             case 'd':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->set_cursor(val, this->col());
                 break;
             case 'f':
             case 'H':
-                switch (csi.args.size()) {
+                switch (csi.n_args) {
                     case 0:
                         this->set_cursor(1, 1);
                         break;
@@ -1059,11 +3523,11 @@ do {                                      \
                 }
                 break;
             case 'G':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 this->set_cursor(this->row(), val);
                 break;
             case 'J':
-                if (csi.args.size() == 0) { goto J_missing; }
+                if (csi.n_args == 0) { goto J_missing; }
                 switch (csi.args[0]) {
                     case 0:
                     J_missing:;
@@ -1073,6 +3537,7 @@ do {                                      \
                         for (int col = this->width(); col >= this->col(); col -= 1) {
                             this->set_cell(this->row(), col, GLYPH(""));
                         }
+                        this->screen().set_wrapped(this->row(), 0);
                         break;
                     case 1:
                         for (int row = 1; row < this->row(); row += 1) {
@@ -1094,13 +3559,14 @@ do {                                      \
                 }
                 break;
             case 'K':
-                if (csi.args.size() == 0) { goto K_missing; }
+                if (csi.n_args == 0) { goto K_missing; }
                 switch (csi.args[0]) {
                     case 0:
                     K_missing:;
                         for (int col = this->width(); col >= this->col(); col -= 1) {
                             this->set_cell(this->row(), col, GLYPH(""));
                         }
+                        this->screen().set_wrapped(this->row(), 0);
                         break;
                     case 1:
                         for (int col = 1; col <= this->col(); col += 1) {
@@ -1116,25 +3582,25 @@ do {                                      \
                 }
                 break;
             case 'L':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 for (int i = 0; i < val; i += 1) {
                     this->insert_line(this->row());
                 }
                 break;
             case 'M':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 for (int i = 0; i < val; i += 1) {
                     this->delete_line(this->row());
                 }
                 break;
             case 'P':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 for (int i = 0; i < val; i += 1) {
                     this->delete_current_cell();
                 }
                 break;
             case 'l':
-                val = csi.args.size() ? csi.args[0] : 0;
+                val = csi.get(0, 0);
                 switch (val) {
                     default:
                         goto unhandled;
@@ -1142,7 +3608,7 @@ do {                                      \
                 }
                 break;
             case 'h':
-                val = csi.args.size() ? csi.args[0] : 0;
+                val = csi.get(0, 0);
                 switch (val) {
                     default:
                         goto unhandled;
@@ -1151,7 +3617,7 @@ do {                                      \
                 break;
             case PRIV('h'):
                 /* DEC Private modes enable. */
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 switch (val) {
                     case 1:
                         this->app_keys = 1;
@@ -1168,13 +3634,20 @@ do {                                      \
                     case 25:
                         /* Ignore cursor show/hide. */
                         break;
+                    case 47:
+                        this->switch_screen(&this->alt_screen);
+                        DBG("alt_screen ON");
+                        break;
                     case 1049:
-                        this->_screen = &this->alt_screen;
+                        this->switch_screen(&this->alt_screen);
                         this->set_cursor(1, 1);
                         this->clear_page();
-                        this->screen().make_dirty();
                         DBG("alt_screen ON");
                         break;
+                    case 2026:
+                        /* Synchronized output: the buffer isn't flushed until the frame ends. */
+                        if (!this->sync_start) { this->sync_start = measure_time_now_ms(); }
+                        break;
                     default:;
                         goto unhandled;
                         break;
@@ -1182,7 +3655,7 @@ do {                                      \
                 break;
             case PRIV('l'):
                 /* DEC Private modes disable. */
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 switch (val) {
                     case 1:
                         this->app_keys = 0;
@@ -1199,22 +3672,50 @@ do {                                      \
                     case 25:
                         /* Ignore cursor show/hide. */
                         break;
+                    case 47:
                     case 1049:
-                        this->_screen = &this->main_screen;
-                        this->screen().make_dirty();
+                        this->switch_screen(&this->main_screen);
                         DBG("alt_screen OFF");
                         break;
+                    case 2026:
+                        this->sync_start = 0;
+                        break;
                     default:;
                         goto unhandled;
                         break;
                 }
                 break;
+            case PRIV('p') | ('$' << 16): { /* Report DEC private mode. */
+                int set;
+
+                val = csi.get(0, 0);
+                switch (val) {
+                    case 1:    set = this->app_keys; break;
+                    case 7:    set = this->auto_wrap; break;
+                    case 47:
+                    case 1049: set = &this->screen() == &this->alt_screen; break;
+                    case 2026: set = this->sync_start != 0; break;
+                    default:   set = -1;
+                }
+
+                auto response =    "\e[?"
+                                 + std::to_string(val)
+                                 + ";"
+                                 + std::to_string(set < 0 ? 0 : 2 - set)
+                                 + "$y";
+                this->send(response);
+                break;
+            }
             case 'm':
-                if (csi.args.size() == 0) { csi.args.push_back(0); }
+                if (csi.n_args == 0) { csi.push_arg(); }
+
+                for (int i = 0; i < csi.n_args;) {
+                    auto cmd = csi.args[i];
+                    int  sub = csi.is_sub(i + 1);
+                    int  kind;
+                    u32  color;
 
-                while (csi.args.size()) {
-                    auto cmd = csi.args[0];
-                    SHIFT();
+                    i += 1;
 
                     switch (cmd) {
                         case 0:
@@ -1230,7 +3731,12 @@ do {                                      \
                             /* Italic mode ignored. */
                             break;
                         case 4:
-                            this->current_attrs.flags |= ATTR_UNDERLINE;
+                            /* 4:0 is "no underline"; other underline styles are drawn as plain underline. */
+                            if (sub && csi.get(i) == 0) {
+                                this->current_attrs.flags &= ~ATTR_UNDERLINE;
+                            } else {
+                                this->current_attrs.flags |= ATTR_UNDERLINE;
+                            }
                             break;
                         case 5:
                             /* Blinking mode ignored. */
@@ -1276,28 +3782,13 @@ do {                                      \
                             ATTR_SET_FG_KIND(this->current_attrs.flags, ATTR_KIND_16);
                             this->current_attrs.fg = cmd;
                             break;
-                        case 38: {
-                            auto which = csi.args[0];
-                            SHIFT();
-                            switch (which) {
-                                case 2: {
-                                    auto r = csi.args[0]; SHIFT();
-                                    auto g = csi.args[0]; SHIFT();
-                                    auto b = csi.args[0]; SHIFT();
-                                    ATTR_SET_FG_KIND(this->current_attrs.flags, ATTR_KIND_RGB);
-                                    this->current_attrs.fg     = RGB_32(r, g, b);
-                                    this->current_attrs.flags &= ~(ATTR_16_LIGHT_FG | ATTR_16_LIGHT_BG);
-                                    break;
-                                }
-                                case 5:
-                                    ATTR_SET_FG_KIND(this->current_attrs.flags, ATTR_KIND_256);
-                                    this->current_attrs.fg     = csi.args[0];
-                                    this->current_attrs.flags &= ~(ATTR_16_LIGHT_FG | ATTR_16_LIGHT_BG);
-                                    SHIFT();
-                                    break;
+                        case 38:
+                            if (csi.extended_color(i, &kind, &color)) {
+                                ATTR_SET_FG_KIND(this->current_attrs.flags, kind);
+                                this->current_attrs.fg     = color;
+                                this->current_attrs.flags &= ~(ATTR_16_LIGHT_FG | ATTR_16_LIGHT_BG);
                             }
                             break;
-                        }
                         case 39:
                             ATTR_SET_FG_KIND(this->current_attrs.flags, ATTR_KIND_NONE);
                             this->current_attrs.fg = 0;
@@ -1307,28 +3798,13 @@ do {                                      \
                             ATTR_SET_BG_KIND(this->current_attrs.flags, ATTR_KIND_16);
                             this->current_attrs.bg     = cmd - 10;
                             break;
-                        case 48: {
-                            auto which = csi.args[0];
-                            SHIFT();
-                            switch (which) {
-                                case 2: {
-                                    auto r = csi.args[0]; SHIFT();
-                                    auto g = csi.args[0]; SHIFT();
-                                    auto b = csi.args[0]; SHIFT();
-                                    ATTR_SET_BG_KIND(this->current_attrs.flags, ATTR_KIND_RGB);
-                                    this->current_attrs.bg     = RGB_32(r, g, b);
-                                    this->current_attrs.flags &= ~(ATTR_16_LIGHT_FG | ATTR_16_LIGHT_BG);
-                                    break;
-                                }
-                                case 5:
-                                    ATTR_SET_BG_KIND(this->current_attrs.flags, ATTR_KIND_256);
-                                    this->current_attrs.bg     = csi.args[0];
-                                    this->current_attrs.flags &= ~(ATTR_16_LIGHT_FG | ATTR_16_LIGHT_BG);
-                                    SHIFT();
-                                    break;
+                        case 48:
+                            if (csi.extended_color(i, &kind, &color)) {
+                                ATTR_SET_BG_KIND(this->current_attrs.flags, kind);
+                                this->current_attrs.bg     = color;
+                                this->current_attrs.flags &= ~(ATTR_16_LIGHT_FG | ATTR_16_LIGHT_BG);
                             }
                             break;
-                        }
                         case 49:
                             ATTR_SET_BG_KIND(this->current_attrs.flags, ATTR_KIND_NONE);
                             this->current_attrs.bg = 0;
@@ -1347,16 +3823,19 @@ do {                                      \
                             goto unhandled;
                             break;
                     }
+
+                    /* Skip sub-parameters that weren't consumed above. */
+                    while (csi.is_sub(i)) { i += 1; }
                 }
                 break;
             case XTERM('m'):
                 /* Ignore xterm key modifier options. */
                 break;
             case 'n':
-                val = csi.args.size() ? csi.args[0] : 0;
+                val = csi.get(0, 0);
                 switch (val) {
                     case '5': /* Report status OK. */
-                        write(this->master_fd, "\e[0n", 4);
+                        this->send("\e[0n", 4);
                         break;
                     case '6': { /* Report cursor location. */
                         auto response =    "\e["
@@ -1364,7 +3843,7 @@ do {                                      \
                                          + ";"
                                          + std::to_string(this->col())
                                          + "R";
-                        write(this->master_fd, response.c_str(), response.size());
+                        this->send(response);
                         break;
                     }
                 }
@@ -1375,14 +3854,13 @@ do {                                      \
                 this->set_scroll(0, 0);
                 this->clear_page();
                 this->app_keys = 0;
-                this->_screen = &this->main_screen;
-                this->main_screen.make_dirty();
+                this->switch_screen(&this->main_screen);
                 break;
             case 'r':
                 /* Set scrolling region. */
                 this->set_cursor(1, 1);
 
-                switch (csi.args.size()) {
+                switch (csi.n_args) {
                     case 0:
                         this->set_scroll(0, 0);
                         break;
@@ -1397,20 +3875,19 @@ do {                                      \
                 }
                 break;
             case 'S':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 for (int i = 0; i < val; i += 1) {
                     this->scroll_up();
                 }
                 break;
             case 'T':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 for (int i = 0; i < val; i += 1) {
                     this->scroll_down();
                 }
                 break;
             case 't':
-                SHIFT();
-                switch (csi.args.size()) {
+                switch (csi.n_args - 1) {
                     case 2:
                         /* Ignore bell volume. */
                         break;
@@ -1423,7 +3900,7 @@ do {                                      \
                 /* Ignore xterm title mode controls. */
                 break;
             case 'X':
-                val = csi.args.size() ? csi.args[0] : 1;
+                val = csi.get(0, 1);
                 for (int i = 0; i < val; i += 1) {
                     this->set_cell(this->row(), this->col() + i, GLYPH(""));
                 }
@@ -1451,11 +3928,11 @@ do {                                      \
                             0xff, 0xff,
                             0xff, 0xff,
                             0xff, 0xff);
-                    write(this->master_fd, buff, strlen(buff));
+                    this->send(buff, strlen(buff));
                 }
                 break;
             case 52:
-                printf("\e]52;c;%s\a", osc.arg.c_str() + 2);
+                this->passthrough.push_back("\e]52;c;" + osc.arg.substr(MIN(osc.arg.size(), 2)) + "\a");
                 break;
             }
             case 104: case 110: case 111:
@@ -1468,353 +3945,521 @@ do {                                      \
         }
     }
 
-    void update() {
-        int                      do_log = yed_var_is_truthy("terminal-debug-log");
-        std::vector<char>        buff;
-        static std::string       incomplete_csi;
-        static int               incomplete_esc;
-        static std::vector<char> incomplete_utf8;
-        int                      dectst     = 0;
-        int                      setcharset = 0;
+    void dump_debug() {
+        if (this->parser.debug.size()) {
+            DBG("'%s'", this->parser.debug.c_str());
+            this->parser.debug.clear();
+        }
+    }
 
-        if (this->delay_update) {
-            this->delay_update = 0;
-            return;
+    void linefeed() {
+        if (this->row() == this->scbottom()) {
+            this->scroll_up();
+        } else {
+            this->move_cursor(1, 0);
+        }
+    }
+
+    void put(yed_glyph *g) {
+        if (this->wrap_next) {
+            if (this->col() == this->width()) {
+                this->screen().set_wrapped(this->row(), 1);
+                this->linefeed();
+                this->set_cursor(this->row(), 1);
+            }
+            this->wrap_next = 0;
+        }
+
+        this->set_current_cell(g);
+        if (this->col() == this->width() && this->auto_wrap) {
+            this->wrap_next = 1;
+        } else {
+            this->move_cursor(0, yed_get_glyph_width(g), /* cancel_wrap = */ 0);
         }
+    }
 
-        this->update_waiting = 1;
-        std::lock_guard<std::mutex> lock(this->buff_lock);
-        this->update_waiting = 0;
+    /* Same as calling put() on each byte of s, with wrap and cursor bookkeeping done once per row. */
+    void put_ascii(const char *s, int n) {
+        while (n > 0) {
+            if (this->wrap_next) {
+                if (this->col() == this->width()) {
+                    this->screen().set_wrapped(this->row(), 1);
+                    this->linefeed();
+                    this->set_cursor(this->row(), 1);
+                }
+                this->wrap_next = 0;
+            }
 
-        buff = std::move(this->data_buff);
-        this->data_buff.clear();
+            int col  = this->col();
+            int room = this->width() - col + 1;
 
-        if (incomplete_esc) {
-            buff.insert(buff.begin(), '\e');
-            incomplete_esc = 0;
-        } else if (incomplete_csi.size()) {
-            for (auto it = incomplete_csi.rbegin(); it != incomplete_csi.rend(); it++) {
-                buff.insert(buff.begin(), *it);
+            if (n < room) {
+                this->screen().set_ascii(this->row(), col, s, n);
+                this->move_cursor(0, n, /* cancel_wrap = */ 0);
+                return;
             }
-            incomplete_csi.clear();
-        } else if (incomplete_utf8.size()) {
-            for (auto it = incomplete_utf8.rbegin(); it != incomplete_utf8.rend(); it++) {
-                buff.insert(buff.begin(), *it);
+
+            if (!this->auto_wrap) {
+                /* Everything past the margin lands on the last column. */
+                this->screen().set_ascii(this->row(), col, s, room - 1);
+                this->screen().set_ascii(this->row(), this->width(), s + n - 1, 1);
+                this->move_cursor(0, room - 1, /* cancel_wrap = */ 0);
+                return;
             }
-            incomplete_utf8.clear();
+
+            this->screen().set_ascii(this->row(), col, s, room);
+            this->move_cursor(0, room - 1, /* cancel_wrap = */ 0);
+            this->wrap_next = 1;
+
+            s += room;
+            n -= room;
         }
+    }
+
+    void execute_control(char c) {
+        if (this->parser.do_log && c) {
+            char pc = c == 0x7F ? '?' : (c | 0x40);
 
-        if (buff.size() && buff.back() == '\e') {
-            incomplete_esc = 1;
-            buff.pop_back();
+            this->dump_debug();
+            this->parser.debug += '^';
+            this->parser.debug += pc;
+            this->dump_debug();
         }
 
-        buff.push_back(0);
+        switch (c) {
+            case '\r':
+                this->set_cursor(this->row(), 1);
+                break;
+            case CTRL_H:
+                this->move_cursor(0, -1);
+                break;
+            case '\f':
+            case '\v':
+            case '\n':
+                this->linefeed();
+                break;
+            case '\t':
+                do {
+                    if (this->col() == this->width()) { break; }
 
-#define DUMP_DEBUG()                \
-do {                                \
-    if (do_log && debug.size()) {   \
-        DBG("'%s'", debug.c_str()); \
-        debug.clear();              \
-    }                               \
-} while (0)
+                    this->set_current_cell(GLYPH(" "));
+                    this->move_cursor(0, 1);
+                } while (this->col() % yed_get_tab_width() != 1);
+                break;
+            case CTRL_G:
+                /* Bell */
+                break;
+            case CTRL_O:
+                /* Switch to standard char set. Ignore. */
+                break;
+            default:
+                break;
+        }
+    }
 
-        std::string debug;
-
-        char        *s             = buff.data();
-        size_t       len           = buff.size() - 1;
-        yed_glyph   *git           = NULL;
-        yed_glyph    last          = yed_glyph_copy(GLYPH(""));
-        int          csi_countdown = 0;
-        char        *p             = NULL;
-        char         c             = 0;
-        int          glyph_len     = 0;
-
-        { BUFF_WRITABLE_GUARD(this->buffer);
-            yed_glyph_traverse_n(s, len, git) {
-                if (csi_countdown) {
-                    csi_countdown -= 1;
-                    continue;
+    void execute_ESC(int inter, char c) {
+        if (this->parser.do_log) { this->dump_debug(); }
+
+        if (inter) {
+            DBG("ESC %c%c", inter, c);
+        } else if (!isprint(c)) {
+            DBG("ESC 0x%x", c);
+        } else {
+            DBG("ESC %c", c);
+        }
+
+        switch (inter) {
+            case 0:
+                break;
+            case '#':
+                if (c == '8') {
+                    /* DEC screen alignment test. */
+                    this->reset();
+                    for (int row = 1; row <= this->height(); row += 1) {
+                        for (int col = this->width(); col >= this->col(); col -= 1) {
+                            this->set_cell(row, col, GLYPH("E"));
+                        }
+                    }
+                }
+                return;
+            case '(':
+            case ')':
+            case '*':
+            case '+':
+                /* Ignore character set setting. */
+                return;
+            default:
+                DBG("UNHANDLED ESC 0x%x 0x%x", inter, c);
+                return;
+        }
+
+        switch (c) {
+            case '\\':
+                /* String terminator. */
+                break;
+            case '=':
+                /* Ignore DECKPAM. */
+                break;
+            case '>':
+                /* Ignore DECKPNM. */
+                break;
+            case '7':
+                this->save_cursor();
+                break;
+            case '8':
+                if (this->cursor_saved()) {
+                    this->restore_cursor();
+                } else {
+                    this->set_cursor(1, 1);
+                    this->current_attrs = ZERO_ATTR;
+                }
+                break;
+            case 'D':
+            case 'E':
+                this->linefeed();
+                if (c == 'E') {
+                    this->set_cursor(this->row(), 1);
+                }
+                break;
+            case 'M':
+                if (this->row() == this->sctop()) {
+                    this->scroll_down();
+                } else {
+                    this->move_cursor(-1, 0);
                 }
+                break;
+            case 'g':
+                /* Flash */
+                break;
+            default:;
+                DBG("UNHANDLED ESC 0x%x", c);
+        }
+    }
 
-/*                 ASSERT(incomplete_csi.size() == 0, "incomplete in middle of stream"); */
+    /* Controls that are legal in the middle of escape and control sequences. */
+    void control(unsigned char c) {
+        switch (c) {
+            case '\e':
+                this->parser.state = PARSE_ESC;
+                break;
+            case 0x18: /* CAN */
+            case 0x1A: /* SUB */
+                this->parser.state = PARSE_GROUND;
+                break;
+            default:
+                this->execute_control(c);
+        }
+    }
 
-                p         = &git->c;
-                c         = *p;
-                glyph_len = yed_get_glyph_len(git);
+    void feed(const char *bytes, size_t len) {
+        Parser        &p = this->parser;
+        unsigned char  c;
+
+        for (size_t i = 0; i < len; i += 1) {
+            c = bytes[i];
+
+reswitch:;
+            switch (p.state) {
+                case PARSE_GROUND:
+                    if (c >= 0x20 && c < 0x7F) {
+                        size_t n = 1 + scan_printable(bytes + i + 1, len - i - 1);
+
+                        if (p.do_log) { p.debug.append(bytes + i, n); }
+                        this->put_ascii(bytes + i, n);
+                        i += n - 1;
+                    } else if (c < 0x20 || c == 0x7F) {
+                        this->control(c);
+                    } else if (c >= 0xC0 && c < 0xF8) {
+                        p.start_utf8(c);
+                    }
+                    /* Stray continuation bytes and invalid lead bytes are dropped. */
+                    break;
 
-                if (glyph_len > 1) { goto put_utf8; }
+                case PARSE_UTF8:
+                    if ((c & 0xC0) != 0x80) {
+                        /* Truncated glyph. Drop it and reprocess this byte. */
+                        p.state = PARSE_GROUND;
+                        goto reswitch;
+                    }
+                    if (p.add_utf8(c)) {
+                        p.state = PARSE_GROUND;
+                        this->put(&p.utf8);
+                    }
+                    break;
 
-                if (dectst) {
+                case PARSE_ESC:
+                    if (c < 0x20) {
+                        this->control(c);
+                        break;
+                    }
                     switch (c) {
-                        case '8':
-                            this->reset();
-                            for (int row = 1; row <= this->height(); row += 1) {
-                                for (int col = this->width(); col >= this->col(); col -= 1) {
-                                    this->set_cell(row, col, GLYPH("E"));
-                                }
-                            }
+                        case '[':
+                            p.csi.clear();
+                            p.state = PARSE_CSI;
                             break;
+                        case ']':
+                            p.osc.clear();
+                            p.state = PARSE_OSC;
+                            break;
+                        case 'k':
+                        case 'P':
+                            /* Device Control String */
+                            p.dcs.clear();
+                            p.state = PARSE_DCS;
+                            break;
+                        default:
+                            if (c <= 0x2F) {
+                                p.esc_inter = c;
+                                p.state     = PARSE_ESC_INTER;
+                            } else {
+                                p.state = PARSE_GROUND;
+                                this->execute_ESC(0, c);
+                            }
                     }
-                    dectst = 0;
-                    goto next;
-                } else if (setcharset) {
-                    /* Ignore character set setting. */
-                    setcharset = 0;
-                    goto next;
-                }
+                    break;
+
+                case PARSE_ESC_INTER:
+                    if (c < 0x20) {
+                        this->control(c);
+                    } else if (c > 0x2F) {
+                        p.state = PARSE_GROUND;
+                        this->execute_ESC(p.esc_inter, c);
+                    }
+                    break;
 
-                if (last.c == '\e') {
-                    if (c != '[' && c != ']') {
-                        if (!isprint(c)) {
-                            DBG("ESC 0x%x", c);
+                case PARSE_CSI:
+                    if (is_digit(c)) {
+                        p.csi.digit(c);
+                    } else if (c == ';' || c == ':') {
+                        p.csi.next_arg(c);
+                    } else if (c >= '<' && c <= '?') {
+                        if (p.csi.mode || p.csi.in_args) {
+                            p.state = PARSE_CSI_IGNORE;
                         } else {
-                            DBG("ESC %c", c);
+                            p.csi.mode = c;
                         }
+                    } else {
+                        goto csi_inter;
                     }
+                    break;
 
-                    switch (c) {
-                        case '\\':
-                            /* String terminator. */
-                            break;
-                        case '[': {
-                            CSI csi(p + 1);
+                case PARSE_CSI_INTER:
+csi_inter:;
+                    if (c < 0x20) {
+                        this->control(c);
+                    } else if (c <= 0x2F) {
+                        if (c == '!' && !p.csi.mode) {
+                            p.csi.mode = MODE_RESET;
+                        } else {
+                            p.csi.intermediate = c;
+                        }
+                        p.state = PARSE_CSI_INTER;
+                    } else if (c <= 0x3F) {
+                        p.state = PARSE_CSI_IGNORE;
+                    } else if (c <= 0x7E) {
+                        p.state = PARSE_GROUND;
+                        p.csi.finish(c);
+                        if (p.do_log) { this->dump_debug(); }
+                        DBG("CSI: '\\e[%s'", p.csi.str().c_str());
+                        this->stats.csi += 1;
+                        this->execute_CSI(p.csi);
+                    }
+                    break;
 
-                            DUMP_DEBUG();
+                case PARSE_CSI_IGNORE:
+                    if (c < 0x20) {
+                        this->control(c);
+                    } else if (c >= 0x40 && c <= 0x7E) {
+                        DBG("WARN: invalid CSI ending in '%c'", c);
+                        p.state = PARSE_GROUND;
+                    }
+                    break;
 
-                            if (csi.complete) {
-                                DBG("CSI: '\\e[%.*s'", csi.len, p + 1);
-                                this->execute_CSI(csi);
-                                csi_countdown = csi.len;
-                            } else {
-                                if (*(p + 1 + csi.len) == 0) {
-                                    DBG("INCOMPLETE CSI: '\\e[%.*s'", csi.len, p + 1);
-                                    incomplete_csi.clear();
-                                    incomplete_csi += "\e[";
-                                    for (int i = 0; i < csi.len; i += 1) {
-                                        incomplete_csi += *(p + 1 + i);
-                                    }
-                                } else {
-                                    DBG("WARN: invalid/incomplete CSI: '\\e[%.*s'", csi.len, p + 1);
-                                }
-
-                                csi_countdown = incomplete_csi.size();
-                            }
+                case PARSE_OSC:
+                    if (c == CTRL_G) {
+                        goto osc_end;
+                    } else if (c == '\e') {
+                        p.state = PARSE_OSC_ESC;
+                    } else if (c == 0x18 || c == 0x1A) {
+                        p.state = PARSE_GROUND;
+                    } else if (c >= 0x20) {
+                        p.osc.put(c);
+                    }
+                    break;
 
-                            break;
-                        }
-                        case ']': {
-                            OSC osc(p + 1);
-                            csi_countdown = osc.len;
+                case PARSE_OSC_ESC:
+                    if (c != '\\') {
+                        DBG("WARN: unterminated OSC '\\e]%ld;%s'", p.osc.command, p.osc.arg.c_str());
+                        p.state = PARSE_ESC;
+                        goto reswitch;
+                    }
+osc_end:;
+                    p.state = PARSE_GROUND;
+                    if (p.do_log) { this->dump_debug(); }
+                    DBG("OSC: '\\e]%ld;%s'", p.osc.command, p.osc.arg.c_str());
+                    this->stats.osc += 1;
+                    this->execute_OSC(p.osc);
+                    break;
+
+                case PARSE_DCS:
+                    if (c == '\e') {
+                        p.state = PARSE_DCS_ESC;
+                    } else if (c == 0x18 || c == 0x1A) {
+                        p.state = PARSE_GROUND;
+                    } else {
+                        p.dcs.put(c);
+                    }
+                    break;
 
-                            DUMP_DEBUG();
+                case PARSE_DCS_ESC:
+                    if (c != '\\') {
+                        p.state = PARSE_ESC;
+                        goto reswitch;
+                    }
+                    p.state = PARSE_GROUND;
+                    if (p.do_log) { this->dump_debug(); }
+                    DBG("DCS: '\\eP%s'", p.dcs.str.c_str());
+                    this->stats.dcs += 1;
+                    break;
+            }
+        }
+    }
 
-                            if (osc.complete) {
-                                DBG("OSC: '\\e]%.*s'", osc.len, p + 1);
-                                this->execute_OSC(osc);
-                            } else {
-                                if (*(p + 1 + osc.len) == 0) {
-                                    DBG("INCOMPLETE OSC: '\\e]%.*s'", osc.len, p + 1);
-                                    incomplete_csi.clear();
-                                    incomplete_csi += "\e]";
-                                    for (int i = 0; i < osc.len; i += 1) {
-                                        incomplete_csi += *(p + 1 + i);
-                                    }
-                                } else {
-                                    DBG("WARN: invalid/incomplete OSC: '\\e]%.*s'", osc.len, p + 1);
-                                }
-
-                                csi_countdown = incomplete_csi.size();
-                            }
+    void update() {
+        if (this->delay_update) {
+            this->delay_update = 0;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(this->model_lock);
+        u64                         start = measure_time_now_ns();
+
+        this->parser.do_log = this->log_queue.on = yed_var_is_truthy("terminal-debug-log");
 
-                            break;
-                        }
-                        case 'k':
-                        case 'P': {
-                            /* Device Control String */
-                            DCS dcs(p + 1);
-                            csi_countdown = dcs.len;
+        for (auto &line : this->log_queue.lines) {
+            LOG_FN_ENTER();
+            yed_log("%s", line.c_str());
+            LOG_EXIT();
+        }
+        this->log_queue.lines.clear();
 
-                            DUMP_DEBUG();
+        for (auto &s : this->passthrough) {
+            printf("%s", s.c_str());
+        }
+        this->passthrough.clear();
 
-                            if (dcs.complete) {
-                                DBG("DCS: '\\eP%.*s'", dcs.len, p + 1);
-                            } else {
-                                DBG("INCOMPLETE DCS: '\\eP%.*s'", dcs.len, p + 1);
-                                incomplete_csi.clear();
-                                incomplete_csi += "\eP";
-                                for (int i = 0; i < dcs.len; i += 1) {
-                                    incomplete_csi += *(p + 1 + i);
-                                }
-                            }
+        int fps = get_max_fps();
+        this->frame_ms     = fps > 0 ? 1000 / fps : 0;
+        this->high_water   = (size_t)MAX(get_high_water_mark(), 0);
+        this->fast_forward = yed_var_is_truthy("terminal-fast-forward");
+        this->visible      = this->in_frame();
 
-                            break;
-                        }
-                        case '#':
-                            dectst = 1;
-                            break;
-                        case '=':
-                            /* Ignore DECKPAM. */
-                            break;
-                        case '>':
-                            /* Ignore DECKPNM. */
-                            break;
-                        case '(':
-                            setcharset = 1;
-                            break;
-                        case '7':
-                            this->save_cursor();
-                            break;
-                        case '8':
-                            if (this->cursor_saved()) {
-                                this->restore_cursor();
-                            } else {
-                                this->set_cursor(1, 1);
-                                this->current_attrs = ZERO_ATTR;
-                            }
-                            break;
-                        case 'D':
-                        case 'E':
-                            if (this->row() == this->scbottom()) {
-                                this->scroll_up();
-                            } else {
-                                this->move_cursor(1, 0);
-                            }
-                            if (c == 'E') {
-                                this->set_cursor(this->row(), 1);
-                            }
-                            break;
-                        case 'M':
-                            if (this->row() == this->sctop()) {
-                                this->scroll_down();
-                            } else {
-                                this->move_cursor(-1, 0);
-                            }
-                            break;
-                        case 'g':
-                            /* Flash */
-                            break;
-                        default:;
-                            DBG("UNHANDLED ESC 0x%x", c);
-                            goto put;
-                    }
-                    goto next;
-                }
+        u64 now = measure_time_now_ms();
 
-                if (do_log) {
-                    if (isprint(c)) {
-                        if (last.c != '\e') {
-                            debug += c;
-                        }
-                    } else {
-                        if (c && c != '\e') {
-                            DUMP_DEBUG();
+        /*
+         * Only the model is kept current while nothing shows the buffer, while the
+         * program is in the middle of drawing a synchronized update, or, when fast
+         * forwarding, while the child is still flooding.
+         */
+        if (!this->visible
+        ||  now - this->last_flush < (u64)this->frame_ms
+        ||  (this->sync_start && now - this->sync_start < SYNC_TIMEOUT_MS)
+        ||  (this->fast_forward
+        &&   this->flooding
+        &&   now - this->last_read  < FAST_FORWARD_IDLE_MS
+        &&   now - this->last_flush < FAST_FORWARD_MAX_MS)) {
+
+            this->flush_pending = 1;
+        } else {
+            this->flush();
+        }
 
-                            char pc = 0;
-                            if (c <= 0x1F) {
-                                pc = c | 0x40;
-                                goto dbg_out;
-                            }
+        /* What was read has been drawn, or nobody is looking, so the child may go on. */
+        if (!this->flush_pending || !this->visible) { this->pause_reading(0); }
 
-                            switch (c) {
-                                case 0x7F: pc = '?'; break;
-                            }
+        this->stats.updates   += 1;
+        this->stats.update_ns += measure_time_now_ns() - start;
 
-dbg_out:;
-                            debug += '^';
-                            debug += pc;
-                            DUMP_DEBUG();
-                        }
-                    }
-                }
+        if (measure_time_now_ms() - this->stats.last_published >= STATS_VAR_INTERVAL_MS) {
+            this->publish_stats(0);
+        }
+    }
 
-                switch (c) {
-                    case 0:
-                        break;
-                    case '\e':
-                        if (incomplete_csi.size()) { incomplete_csi.clear(); }
-                        if (!*(p + 1)) { incomplete_csi = "\e"; }
-                        break;
-                    case '\r':
-                        this->set_cursor(this->row(), 1);
-                        break;
-                    case CTRL_H:
-                        this->move_cursor(0, -1);
-                        break;
-                    case '\f':
-                    case '\v':
-                    case '\n':
-                        if (this->row() == this->scbottom()) {
-                            this->scroll_up();
-                        } else {
-                            this->move_cursor(1, 0);
-                        }
-                        break;
-                    case '\t':
-                        do {
-                            if (this->col() == this->width()) { break; }
+    /*
+     * Mirrors stats into terminal-stats-<buffer>-<counter> variables (e.g.
+     * terminal-stats-term0-bytes-read), or removes them.
+     */
+    void publish_stats(int remove) {
+        char        name[256];
+        char        val[32];
+        const char *bname = this->buffer->name;
+
+        if (*bname == '*') { bname += 1; }
+
+        for (auto &stat : this->stats.list()) {
+            snprintf(name, sizeof(name), "terminal-stats-%s-%s", bname, stat.first);
+            if (remove) {
+                yed_unset_var(name);
+            } else {
+                snprintf(val, sizeof(val), "%llu", (unsigned long long)stat.second);
+                yed_set_var(name, val);
+            }
+        }
 
-                            this->set_current_cell(GLYPH(" "));
-                            this->move_cursor(0, 1);
-                        } while (this->col() % yed_get_tab_width() != 1);
-                        break;
-                    case CTRL_G:
-                        /* Bell */
-                        break;
-                    case CTRL_O:
-                        /* Switch to standard char set. Ignore. */
-                        break;
-                    default:
-                    put:;
-                        if (iscntrl(git->c)) { goto next; }
-                    put_utf8:;
-                        if (p + glyph_len > &buff.back()) {
-                            for (int i = 0; p + i < &buff.back(); i += 1) {
-                                if (do_log) {
-                                    debug += git->bytes[i];
-                                }
-
-                                incomplete_utf8.push_back(p[i]);
-                            }
+        this->stats.last_published = measure_time_now_ms();
+    }
 
-                            /* Can't goto next because we might try to copy an incomplete glyph. */
-                            goto out;
-                        }
+    /*
+     * The first buffer row that any frame showing this terminal has in view, or
+     * will have once its cursor is put back on the screen.
+     */
+    int first_shown_row() {
+        yed_frame **it;
+        int         n_rows = this->screen().scrollback + this->height() - this->buffer_top;
+        int         first  = n_rows + 1;
 
-                        if (this->wrap_next) {
-                            if (this->col() == this->width()) {
-                                if (this->row() == this->scbottom()) {
-                                    this->scroll_up();
-                                } else {
-                                    this->move_cursor(1, 0);
-                                }
-                                this->set_cursor(this->row(), 1);
-                            }
-                            this->wrap_next = 0;
-                        }
+        array_traverse(ys->frames, it) {
+            yed_frame *f = *it;
 
-                        this->set_current_cell(git);
-                        if (this->col() == this->width() && this->auto_wrap) {
-                            this->wrap_next = 1;
-                        } else {
-                            this->move_cursor(0, yed_get_glyph_width(git), /* cancel_wrap = */ 0);
-                        }
-                        break;
-                }
-next:;
-                last = yed_glyph_copy(git);
-            }
-out:;
+            if (f->buffer != this->buffer) { continue; }
+
+            first = MIN(first, f->buffer_y_offset + 1);
+            first = MIN(first, n_rows - f->height + 1);
         }
 
-        this->write_to_buffer();
+        return MAX(first, 1);
+    }
+
+    /*
+     * Brings the buffer and cursor up to date with the model, as far as frames
+     * can see. In term mode that is all of the buffer but for a frame shorter than
+     * the screen.
+     */
+    void flush() {
+        this->write_to_buffer(this->first_shown_row());
 
         if (ys->active_frame && ys->active_frame->buffer == this->buffer) {
             this->set_cursor_in_frame(ys->active_frame);
         }
+
+        this->last_flush    = measure_time_now_ms();
+        this->flush_pending = 0;
+        this->backlog       = 0;
+    }
+
+    int in_frame() {
+        yed_frame **it;
+
+        array_traverse(ys->frames, it) {
+            if ((*it)->buffer == this->buffer) { return 1; }
+        }
+
+        return 0;
     }
 
     void keys(int len, int *keys) {
+        std::string seq;
+
         for (int i = 0; i < len; i += 1) {
             int key = keys[i];
             if (IS_MOUSE(key)) {
@@ -1837,8 +4482,8 @@ out:;
                 case ARROW_LEFT:
                 case HOME_KEY:
                 case END_KEY: {
-                    char chars[2] = { '\e', this->app_keys ? 'O' : '[' };
-                    write(this->master_fd, chars, 2);
+                    seq += '\e';
+                    seq += this->app_keys ? 'O' : '[';
                     break;
                 }
                 default:
@@ -1846,85 +4491,93 @@ out:;
             }
             switch (key) {
                 case ARROW_UP:
-                    write(this->master_fd, "A", 1);
+                    seq += "A";
                     break;
                 case ARROW_DOWN:
-                    write(this->master_fd, "B", 1);
+                    seq += "B";
                     break;
                 case ARROW_RIGHT:
-                    write(this->master_fd, "C", 1);
+                    seq += "C";
                     break;
                 case ARROW_LEFT:
-                    write(this->master_fd, "D", 1);
+                    seq += "D";
                     break;
                 case DEL_KEY:
-                    write(this->master_fd, "P", 1);
+                    seq += "P";
                     break;
                 case HOME_KEY:
-                    write(this->master_fd, "H", 1);
+                    seq += "H";
                     break;
                 case END_KEY:
-                    write(this->master_fd, "F", 1);
+                    seq += "F";
                     break;
                 case PAGE_UP:
-                    write(this->master_fd, "\e[5~", 4);
+                    seq += "\e[5~";
                     break;
                 case PAGE_DOWN:
-                    write(this->master_fd, "\e[6~", 4);
+                    seq += "\e[6~";
                     break;
                 case SHIFT_TAB:
-                    write(this->master_fd, "\e[Z", 3);
+                    seq += "\e[Z";
                     break;
                 case FN1:
-                    write(this->master_fd, "\eOP", 3);
+                    seq += "\eOP";
                     break;
                 case FN2:
-                    write(this->master_fd, "\eOQ", 3);
+                    seq += "\eOQ";
                     break;
                 case FN3:
-                    write(this->master_fd, "\eOR", 3);
+                    seq += "\eOR";
                     break;
                 case FN4:
-                    write(this->master_fd, "\eOS", 3);
+                    seq += "\eOS";
                     break;
                 case FN5:
-                    write(this->master_fd, "\e[15~", 5);
+                    seq += "\e[15~";
                     break;
                 case FN6:
-                    write(this->master_fd, "\e[17~", 5);
+                    seq += "\e[17~";
                     break;
                 case FN7:
-                    write(this->master_fd, "\e[18~", 5);
+                    seq += "\e[18~";
                     break;
                 case FN8:
-                    write(this->master_fd, "\e[19~", 5);
+                    seq += "\e[19~";
                     break;
                 case FN9:
-                    write(this->master_fd, "\e[20~", 5);
+                    seq += "\e[20~";
                     break;
                 case FN10:
-                    write(this->master_fd, "\e[21~", 5);
+                    seq += "\e[21~";
                     break;
                 case FN11:
-                    write(this->master_fd, "\e[23~", 5);
+                    seq += "\e[23~";
                     break;
                 case FN12:
-                    write(this->master_fd, "\e[24~", 5);
+                    seq += "\e[24~";
                     break;
                 case MENU_KEY:
-                    write(this->master_fd, "\e[29~", 5);
+                    seq += "\e[29~";
                     break;
                 default:
-                    char c = key;
-                    write(this->master_fd, &c, 1);
+                    seq += (char)key;
             }
         }
+
+        this->send(seq);
     }
 
     void paste(const char *bytes) {
-        write(this->master_fd, "\e[200~", 6);
-        write(this->master_fd, bytes, strlen(bytes));
-        write(this->master_fd, "\e[201~", 6);
+        struct iovec iov[3];
+
+        iov[0].iov_base = (void*)"\e[200~";
+        iov[0].iov_len  = 6;
+        iov[1].iov_base = (void*)bytes;
+        iov[1].iov_len  = strlen(bytes);
+        iov[2].iov_base = (void*)"\e[201~";
+        iov[2].iov_len  = 6;
+
+        this->sendv(iov, 3);
     }
 
     void fit_to_frames() {
@@ -1934,125 +4587,516 @@ out:;
         yed_frame **fit;
         yed_frame  *f;
 
-        in_frame = 0;
-        width    = INT_MAX;
-        height   = INT_MAX;
+        in_frame = 0;
+        width    = INT_MAX;
+        height   = INT_MAX;
+
+        array_traverse(ys->frames, fit) {
+            f = *fit;
+            if (f->buffer != this->buffer) { continue; }
+
+            in_frame = 1;
+
+            if (f->width < width || f->height < height) {
+                width  = f->width;
+                height = f->height;
+            }
+        }
+
+        if (in_frame) {
+            std::lock_guard<std::mutex> lock(this->model_lock);
+
+            this->resize(width, height);
+
+            array_traverse(ys->frames, fit) {
+                f = *fit;
+                if (f->buffer == this->buffer) {
+                    this->set_cursor_in_frame(f);
+                }
+            }
+        }
+    }
+
+    void apply_attrs(yed_event *event) {
+        yed_frame *frame;
+        int        row;
+
+        frame = event->frame;
+        row   = event->row;
+
+        std::lock_guard<std::mutex> lock(this->model_lock);
+
+        /* The buffer may not have caught up with the model yet; find the line that it still shows. */
+        row = this->screen().model_row(row);
+        if (row < 1) { return; }
+
+        auto &screen = this->screen_of(row);
+
+        row -= screen.base();
+
+        /* Default attributes combine to nothing, so only the runs that aren't are applied. */
+        if (row <= screen.cold.cap) {
+            auto  l        = screen.cold.get(row - 1);
+            auto *resolved = screen.cold.resolved_runs(row - 1);
+
+            for (int run = 0; run < l.n_runs; run += 1) {
+                if (attrs_equal(l.runs[run].attrs, ZERO_ATTR)) { continue; }
+
+                this->combine_span(event,
+                                   l.runs[run].col + 1,
+                                   MIN(l.runs[run].col + l.runs[run].len, this->width()) + 1,
+                                   resolved[run]);
+            }
+
+            return;
+        }
+
+        auto &line = screen[row - screen.cold.cap - 1];
+        int   n    = MIN(line.size(), this->width());
+
+        for (int col = 1, end; col <= n; col = end) {
+            u16 attr = line[col - 1].attr;
+
+            for (end = col + 1; end <= n && line[end - 1].attr == attr; end += 1);
+
+            if (attr != 0) {
+                this->combine_span(event, col, end, screen.resolved_attrs(attr));
+            }
+        }
+    }
+
+    /* The screen whose model holds buffer row row. The main screen's scrollback is still shown above the alternate screen. */
+    Screen& screen_of(int row) {
+        auto &shown = this->screen();
+        return row <= shown.base() ? this->main_screen : shown;
+    }
+
+    /*
+     * Does yank-selection from the model instead of the buffer, so that rows that
+     * autowrapped are yanked as the one line they were written as. A line-wise
+     * selection takes in every row of the logical lines at its ends.
+     * Returns 0 for the selections that are left to yed, once their rows are filled in.
+     */
+    int yank_selection() {
+        std::vector<std::string>  lines(1);
+        yed_range                *sel;
+        yed_buffer               *yank;
+        yed_line                  line;
+        int                       r1;
+        int                       c1;
+        int                       r2;
+        int                       c2;
+        int                       first;
+        int                       last;
+
+        if (this->buffer == NULL || !this->buffer->has_selection) { return 0; }
+
+        sel = &this->buffer->selection;
+        if (sel->kind != RANGE_NORMAL && sel->kind != RANGE_LINE) {
+            std::lock_guard<std::mutex> lock(this->model_lock);
+            this->fill(MIN(sel->anchor_row, sel->cursor_row), MAX(sel->anchor_row, sel->cursor_row));
+            return 0;
+        }
+
+        if (sel->anchor_row < sel->cursor_row
+        ||  (sel->anchor_row == sel->cursor_row && sel->anchor_col <= sel->cursor_col)) {
+
+            r1 = sel->anchor_row; c1 = sel->anchor_col;
+            r2 = sel->cursor_row; c2 = sel->cursor_col;
+        } else {
+            r1 = sel->cursor_row; c1 = sel->cursor_col;
+            r2 = sel->anchor_row; c2 = sel->anchor_col;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(this->model_lock);
+
+            r1 = this->screen().model_row(r1);
+            r2 = this->screen().model_row(r2);
+            if (r2 < 1) { return 0; }
+            if (r1 < 1) { r1 = 1; c1 = 1; }
+
+            if (sel->kind == RANGE_LINE) {
+                this->screen_of(r1).logical_line(r1, &r1, &last);
+                this->screen_of(r2).logical_line(r2, &first, &r2);
+                c1 = 1;
+                c2 = INT_MAX;
+            }
+
+            for (int row = r1; row <= r2; row += 1) {
+                auto &screen = this->screen_of(row);
+
+                screen.row_text(row, row == r1 ? c1 : 1, row == r2 ? c2 : INT_MAX, lines.back());
+
+                if (row < r2 && !screen.row_wraps(row)) { lines.emplace_back(); }
+            }
+        }
+
+        yank = yed_get_yank_buffer();
+
+        BUFF_WRITABLE_GUARD(yank);
+
+        yed_buff_clear_no_undo(yank);
+
+        if (sel->kind == RANGE_LINE) {
+            yank->flags |= BUFF_YANK_LINES;
+        } else {
+            yank->flags &= ~BUFF_YANK_LINES;
+        }
+
+        line = yed_new_line_with_cap(this->width());
+
+        for (size_t i = 0; i < lines.size(); i += 1) {
+            const char *text = lines[i].data();
+            yed_glyph  *g;
+
+            yed_clear_line(&line);
+            yed_glyph_traverse_n(text, lines[i].size(), g) { yed_line_append_glyph(&line, g); }
+
+            if (i > 0) { yed_buffer_add_line_no_undo(yank); }
+            yed_buff_set_line_no_undo(yank, i + 1, &line);
+        }
+
+        yed_free_line(&line);
+
+        this->buffer->has_selection = 0;
+
+        return 1;
+    }
+
+    /* Columns [col, end). */
+    void combine_span(yed_event *event, int col, int end, const yed_attrs &attrs) {
+        for (; col < end; col += 1) {
+            yed_attrs a = attrs;
+            yed_eline_combine_col_attrs(event, col, &a);
+        }
+    }
+
+    void toggle_term_mode() {
+        this->term_mode = !this->term_mode;
+
+        {
+            std::lock_guard<std::mutex> lock(this->model_lock);
+
+            this->fit_buffer_to_mode();
+
+            /* The whole buffer is fair game for scrolling and searching now; fill_frames() writes what they reach. */
+            if (!this->term_mode) { this->pause_reading(0); }
+        }
+
+        if (this->term_mode
+        &&  this->buffer
+        &&  this->buffer->has_selection) {
+
+            this->buffer->has_selection = 0;
+        }
+    }
+};
+
+struct Binding {
+    int    len;
+    int    keys[MAX_SEQ_LEN];
+    char  *cmd;
+    int    key;
+    int    n_args;
+    char **args;
+};
+
+#define MAX_IO_EVENTS (64)
+
+struct IO_Ready {
+    Term *term;
+    int   events;
+};
+
+/*
+ * One thread per State waits on every terminal's master fd (epoll, or kqueue on
+ * macOS) and parses what comes in. A ready terminal gets one read per turn, of at
+ * most read_size bytes, parsed in max_block_size blocks with model_lock let go
+ * between them. So a flooding terminal can't starve the others: its fd is still
+ * readable and it is picked up again on the next turn, along with everyone else
+ * that is ready.
+ * Input the pty couldn't take right away is written out here too, as the fd
+ * becomes writable. lock is held while terminals are serviced, so once remove()
+ * returns the loop won't touch that terminal again.
+ * The thread only ends when stop() pokes it through wake_fds, before the plugin
+ * is unloaded.
+ */
+struct IO_Loop {
+    int                       poll_fd     = -1;
+    int                       wake_fds[2] = { -1, -1 };
+    int                       stopping    = 0;
+    std::thread               thr;
+    std::mutex                lock;
+    std::unordered_set<Term*> terms;
+
+    int start() {
+#ifdef __APPLE__
+        this->poll_fd = kqueue();
+#else
+        this->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+        if (this->poll_fd < 0) {
+            ELOG("failed to create I/O poller with errno = %d", errno);
+            errno = 0;
+            return 0;
+        }
+
+        if (pipe(this->wake_fds) != 0) {
+            ELOG("failed to create I/O wake pipe with errno = %d", errno);
+            errno = 0;
+            close(this->poll_fd);
+            this->poll_fd = -1;
+            return 0;
+        }
+
+        for (int fd : this->wake_fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        poll_set(this->poll_fd, this->wake_fds[0], NULL, 0, POLL_READ);
+
+        this->stopping = 0;
+        this->thr      = std::thread(IO_Loop::run, this);
+
+        return 1;
+    }
+
+    /* Lets go of every terminal and waits for the thread to finish. */
+    void stop() {
+        if (this->poll_fd < 0) { return; }
+
+        {
+            std::lock_guard<std::mutex> lock(this->lock);
+
+            for (auto t : this->terms) { this->watch(t, 0); }
+            this->terms.clear();
+            this->stopping = 1;
+        }
+
+        if (write(this->wake_fds[1], "", 1) < 0) { errno = 0; }
+        this->thr.join();
+
+        close(this->wake_fds[0]);
+        close(this->wake_fds[1]);
+        close(this->poll_fd);
+        this->wake_fds[0] = this->wake_fds[1] = this->poll_fd = -1;
+    }
+
+    void watch(Term *t, int on) {
+        std::lock_guard<std::mutex> lock(t->out_lock);
+
+        if (on) {
+            t->poll_fd = this->poll_fd;
+            t->update_poll_events();
+        } else {
+            t->set_poll_events(0);
+            t->poll_fd = -1;
+        }
+    }
+
+    int add(Term *t) {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        if (this->poll_fd < 0 && !this->start()) { return 0; }
+
+        this->terms.insert(t);
+        this->watch(t, 1);
+
+        return 1;
+    }
+
+    void remove(Term *t) {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        if (this->terms.erase(t)) { this->watch(t, 0); }
+    }
+
+    int wait(IO_Ready *ready, int timeout) {
+        int n;
+
+#ifdef __APPLE__
+        struct kevent    evs[MAX_IO_EVENTS];
+        struct timespec  ts;
+        struct timespec *tsp = NULL;
+
+        if (timeout >= 0) {
+            ts.tv_sec  = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            tsp        = &ts;
+        }
+
+        n = kevent(this->poll_fd, NULL, 0, evs, MAX_IO_EVENTS, tsp);
+        for (int i = 0; i < n; i += 1) {
+            ready[i].term   = (Term*)evs[i].udata;
+            ready[i].events = evs[i].filter == EVFILT_WRITE ? POLL_WRITE : POLL_READ;
+        }
+#else
+        struct epoll_event evs[MAX_IO_EVENTS];
+
+        n = epoll_wait(this->poll_fd, evs, MAX_IO_EVENTS, timeout);
+        for (int i = 0; i < n; i += 1) {
+            ready[i].term   = (Term*)evs[i].data.ptr;
+            ready[i].events =   ((evs[i].events & EPOLLOUT) ? POLL_WRITE : 0)
+                              | ((evs[i].events & ~EPOLLOUT) ? POLL_READ : 0);
+        }
+#endif
+
+        return n;
+    }
+
+    int next_timeout(u64 now) {
+        std::lock_guard<std::mutex> lock(this->lock);
+        int                         timeout = -1;
+
+        for (auto t : this->terms) {
+            int ms = t->wake_timeout(now);
+            if (ms >= 0 && (timeout < 0 || ms < timeout)) { timeout = ms; }
+        }
+
+        return timeout;
+    }
+
+    static void run(IO_Loop *loop) {
+        IO_Ready ready[MAX_IO_EVENTS];
+        int      n;
+        u64      now;
+        int      wake;
+
+        for (;;) {
+            n = loop->wait(ready, loop->next_timeout(measure_time_now_ms()));
+
+            if (n < 0) {
+                errno = 0;
+                n     = 0;
+            }
+
+            std::lock_guard<std::mutex> lock(loop->lock);
+
+            if (loop->stopping) { return; }
+
+            now = measure_time_now_ms();
+
+            for (int i = 0; i < n; i += 1) {
+                Term *t = ready[i].term;
 
-        array_traverse(ys->frames, fit) {
-            f = *fit;
-            if (f->buffer != this->buffer) { continue; }
+                if (!loop->terms.count(t)) { continue; }
 
-            in_frame = 1;
+                if (ready[i].events & POLL_WRITE) { t->drain(); }
 
-            if (f->width < width || f->height < height) {
-                width  = f->width;
-                height = f->height;
+                if ((ready[i].events & POLL_READ) && t->service() < 0) {
+                    t->process_exited = 1;
+                    loop->terms.erase(t);
+                    loop->watch(t, 0);
+                }
             }
-        }
 
-        if (in_frame) {
-            this->resize(width, height);
+            /* One redraw serves every terminal that is waiting for one. */
+            wake = 0;
+            for (auto t : loop->terms) {
+                if (t->wake_timeout(now) == 0) { wake = 1; }
+            }
 
-            array_traverse(ys->frames, fit) {
-                f = *fit;
-                if (f->buffer == this->buffer) {
-                    this->set_cursor_in_frame(f);
+            if (wake) {
+                yed_force_update();
+
+                for (auto t : loop->terms) {
+                    if (t->wake_timeout(now) >= 0) {
+                        t->last_wake     = now;
+                        t->wake_deferred = 0;
+                    }
                 }
             }
         }
     }
+};
 
-    void apply_attrs(yed_event *event) {
-        yed_frame *frame;
-        int        row;
-
-        frame = event->frame;
-        row   = event->row;
+struct State {
+    u32                                    term_counter = 0;
+    std::list<Term*>                       terms;
+    std::unordered_map<yed_buffer*, Term*> by_buffer;
+    IO_Loop                                io;
+    std::map<yed_frame*, int>              save_scroll_offsets;
+    std::map<yed_frame*, int>              term_mode_off;
+    int                                    key_sequences_saved = 0;
+    array_t                                key_sequences;
+    std::vector<Binding>                   bindings;
 
-        for (int col = 1; col <= this->width(); col += 1) {
-            auto &line = this->screen()[row - 1];
+    State() { }
 
-            if (col > line.size()) { break; }
+    Term * new_term(const std::vector<std::string> &cmd = {}) {
+        Term *t = this->new_term(this->term_counter, cmd);
+        if (t == NULL) { return NULL; }
 
-            yed_attrs attrs = line[col - 1].attrs;
+        this->term_counter += 1;
 
-            if (ATTR_FG_KIND(attrs.flags) == ATTR_KIND_16 && attrs.fg >= 30 && attrs.fg <= 37) {
-                int fg = attrs.fg - 30 + (!!(attrs.flags & ATTR_16_LIGHT_FG)) * 8;
-                ATTR_SET_FG_KIND(attrs.flags, ATTR_FG_KIND(colors[fg].flags));
-                attrs.fg = colors[fg].fg;
-            }
+        return t;
+    }
 
-            if (ATTR_BG_KIND(attrs.flags) == ATTR_KIND_16 && attrs.bg >= 30 && attrs.bg <= 37) {
-                int bg = attrs.bg - 30 + (!!(attrs.flags & ATTR_16_LIGHT_BG)) * 8;
-                ATTR_SET_BG_KIND(attrs.flags, ATTR_FG_KIND(colors[bg].flags));
-                attrs.bg = colors[bg].fg;
-            }
+    Term * new_term(int num, const std::vector<std::string> &cmd = {}) {
+        Term *t = new Term(num, cmd);
+        if (!t->valid) {
+            delete t;
+            return NULL;
+        }
 
-            yed_eline_combine_col_attrs(event, col, &attrs);
+        if (!this->io.add(t)) {
+            delete t;
+            return NULL;
         }
-    }
 
-    void toggle_term_mode() {
-        this->term_mode = !this->term_mode;
-        if (this->term_mode
-        &&  this->buffer
-        &&  this->buffer->has_selection) {
+        this->terms.push_back(t);
+        this->by_buffer[t->buffer] = t;
 
-            this->buffer->has_selection = 0;
-        }
+        return t;
     }
-};
-
-struct Binding {
-    int    len;
-    int    keys[MAX_SEQ_LEN];
-    char  *cmd;
-    int    key;
-    int    n_args;
-    char **args;
-};
 
-struct State {
-    u32                       term_counter = 0;
-    std::list<Term*>          terms;
-    std::map<yed_frame*, int> save_scroll_offsets;
-    std::map<yed_frame*, int> term_mode_off;
-    int                       key_sequences_saved = 0;
-    array_t                   key_sequences;
-    std::vector<Binding>      bindings;
+    /* A *term# buffer with no child process, for term-replay. */
+    Term * new_detached_term() {
+        char name[64];
 
-    State() { }
+        snprintf(name, sizeof(name), "*term%u", this->term_counter);
 
-    Term * new_term() {
-        Term *t = new Term(this->term_counter);
-        if (!t->valid) { return NULL; }
+        Term *t = new Term(name);
+        if (!t->valid) {
+            delete t;
+            return NULL;
+        }
 
         this->term_counter += 1;
         this->terms.push_back(t);
+        this->by_buffer[t->buffer] = t;
 
         return t;
     }
 
-    Term * new_term(int num) {
-        Term *t = new Term(num);
-        if (!t->valid) { return NULL; }
+    /* A terminal restored from a snapshot, which goes on reading from its child if it has one. */
+    void adopt_term(Term *t) {
+        if (t->master_fd >= 0 && !t->process_exited && !this->io.add(t)) {
+            t->process_exited = 1;
+        }
 
         this->terms.push_back(t);
+        this->by_buffer[t->buffer] = t;
+    }
 
-        return t;
+    /* Callers take t out of terms themselves. */
+    void delete_term(Term *t) {
+        this->io.remove(t);
+        this->by_buffer.erase(t->buffer);
+        delete t;
     }
 };
 
-#define STATE_ADDR_VAR_NAME "__term_state_addr"
-
 static State      *state;
 static yed_plugin *Self;
 
+/* Runs for every drawn row of every frame, so it needs to be cheap for non-terminals too. */
 static Term * term_for_buffer(yed_buffer *buffer) {
-    for (auto t : state->terms) {
-        if (buffer == t->buffer) { return t; }
-    }
-    return NULL;
+    if (buffer == NULL || state->by_buffer.empty()) { return NULL; }
+
+    auto it = state->by_buffer.find(buffer);
+    return it == state->by_buffer.end() ? NULL : it->second;
 }
 
 static void install_bindings() {
@@ -2192,16 +5236,16 @@ static void update(yed_event *event) {
         if (t->process_exited) {
             if (t->bad_shell) {
                 LOG_CMD_ENTER("yed-terminal");
-                yed_cerr("Failed to start shell '%s'", get_shell());
+                yed_cerr("Failed to start '%s'", t->command.c_str());
                 LOG_EXIT();
             }
-            delete t;
+            state->delete_term(t);
             it = state->terms.erase(it);
             it--;
+        } else if (t->term_mode) {
+            t->update();
         } else {
-            if (t->term_mode) {
-                t->update();
-            }
+            t->fill_frames();
         }
     }
 }
@@ -2247,6 +5291,11 @@ static void ins(yed_event *event) {
     if (ys->active_frame == NULL || ys->active_frame->buffer == NULL) { return; }
 
     if (auto t = term_for_buffer(ys->active_frame->buffer)) {
+        if (strcmp(event->cmd_name, "yank-selection") == 0) {
+            if (!t->term_mode && t->yank_selection()) { event->cancel = 1; }
+            return;
+        }
+
         if (strcmp(event->cmd_name, "simple-insert-string") == 0) {
             text = event->args[0];
         } else if (strcmp(event->cmd_name, "paste-yank-buffer") == 0) {
@@ -2278,6 +5327,9 @@ static void line(yed_event *event) {
     if (buff == NULL) { return; }
 
     if (auto t = term_for_buffer(buff)) {
+        /* In case the frame has moved since fill_frames(). */
+        if (!t->term_mode) { t->fill_row(event->row); }
+
         t->apply_attrs(event);
     }
 }
@@ -2333,6 +5385,8 @@ static void sig(yed_event *event) {
     if (event->signum != SIGCHLD) { return; }
 
     for (auto t : state->terms) {
+        if (t->shell_pid == 0) { continue; }
+
         if (waitpid(t->shell_pid, &status, WNOHANG)) {
             if (WIFEXITED(status)) {
                 t->process_exited = 1;
@@ -2396,6 +5450,7 @@ static void focus(yed_event *event) {
 static void parse_color(int which, const char *str) {
     ASSERT(which >= 0 && which <= N_COLORS, "invalid color index");
     colors[which] = str == NULL ? ZERO_ATTR : yed_parse_attrs(str);
+    colors_gen   += 1;
 }
 
 static void var(yed_event *event) {
@@ -2445,7 +5500,27 @@ static void style(yed_event *event) {
 }
 
 static void term_new_cmd(int n_args, char **args) {
-    Term *t = state->new_term();
+    std::vector<std::string> cmd;
+
+    if (n_args > 0) {
+        if (strcmp(args[0], "--") != 0) {
+            yed_cerr("expected '--' before the command, but got '%s'", args[0]);
+            return;
+        }
+        if (n_args == 1) {
+            yed_cerr("expected a command after '--'");
+            return;
+        }
+
+        cmd.assign(args + 1, args + n_args);
+    }
+
+    Term *t = state->new_term(cmd);
+    if (t == NULL) {
+        yed_cerr("failed to create a terminal");
+        return;
+    }
+
     yed_cprint("new terminal buffer %s", t->buffer->name);
 }
 
@@ -2550,6 +5625,247 @@ static void term_feed_text_cmd(int n_args, char **args) {
     }
 }
 
+static void term_stats_cmd(int n_args, char **args) {
+    yed_buffer  *buffer;
+    std::string  out;
+
+    if (n_args > 1) {
+        yed_cerr("expected 0 or 1 arguments, but got %d", n_args);
+        return;
+    }
+
+    if (n_args) {
+        buffer = yed_get_buffer(args[0]);
+        if (buffer == NULL) {
+            yed_cerr("unknown buffer '%s'", args[0]);
+            return;
+        }
+    } else {
+        if (ys->active_frame == NULL || ys->active_frame->buffer == NULL) {
+            yed_cerr("no active frame");
+            return;
+        }
+        buffer = ys->active_frame->buffer;
+    }
+
+    if (auto t = term_for_buffer(buffer)) {
+        std::lock_guard<std::mutex> lock(t->model_lock);
+
+        for (auto &stat : t->stats.list()) {
+            if (!out.empty()) { out += ", "; }
+            out += stat.first;
+            out += ": ";
+            out += std::to_string(stat.second);
+        }
+
+        yed_cprint("%s", out.c_str());
+    } else {
+        yed_cerr("'%s' is not a terminal buffer", buffer->name);
+        return;
+    }
+}
+
+static int read_file(const char *path, std::string &out) {
+    FILE   *f;
+    char    buff[16384];
+    size_t  n;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        errno = 0;
+        return 0;
+    }
+
+    out.clear();
+    while ((n = fread(buff, 1, sizeof(buff), f)) > 0) {
+        out.append(buff, n);
+    }
+
+    fclose(f);
+
+    return 1;
+}
+
+/*
+ * Feeds a capture of raw child output through a terminal with no child, PASSES
+ * times, and reports how fast it was interpreted and written to a buffer.
+ */
+static void term_bench_cmd(int n_args, char **args) {
+    std::string  bytes;
+    int          passes = 1;
+    int          width  = DEFAULT_WIDTH;
+    int          height = DEFAULT_HEIGHT;
+    u64          parse_ns;
+    u64          start;
+    double       total;
+
+    if (n_args < 1 || n_args > 4) {
+        yed_cerr("expected FILE [PASSES [WIDTH HEIGHT]], but got %d arguments", n_args);
+        return;
+    }
+
+    if (n_args >= 2) { passes = MAX(s_to_i(args[1]), 1); }
+    if (n_args == 4) {
+        width  = MAX(s_to_i(args[2]), 1);
+        height = MAX(s_to_i(args[3]), 1);
+    }
+
+    if (!read_file(args[0], bytes)) {
+        yed_cerr("could not read '%s'", args[0]);
+        return;
+    }
+
+    Term *t = new Term("*term-bench");
+
+    t->resize(width, height);
+    t->write_to_buffer();
+    t->stats = Term_Stats();
+
+    thread_log_queue = &t->log_queue;
+
+    parse_ns = 0;
+    for (int i = 0; i < passes; i += 1) {
+        start = measure_time_now_ns();
+        for (size_t off = 0; off < bytes.size(); off += t->max_block_size) {
+            t->feed(bytes.data() + off, MIN(bytes.size() - off, (size_t)t->max_block_size));
+        }
+        parse_ns += measure_time_now_ns() - start;
+
+        t->write_to_buffer();
+    }
+
+    thread_log_queue = NULL;
+
+    total = (double)bytes.size() * passes;
+
+    yed_cprint("%.1f MB in %d pass(es): parse %.1f MB/s (%.2f ns/byte), %llu rows flushed in %.2f ms, %llu lines scrolled",
+               total / 1e6,
+               passes,
+               parse_ns ? total / 1e6 / (parse_ns / 1e9) : 0.0,
+               total ? parse_ns / total : 0.0,
+               (unsigned long long)t->stats.lines_flushed,
+               t->stats.flush_ns / 1e6,
+               (unsigned long long)t->stats.lines_scrolled);
+
+    delete t;
+}
+
+static void term_record_cmd(int n_args, char **args) {
+    yed_buffer *buffer;
+
+    if (n_args < 1 || n_args > 2) {
+        yed_cerr("expected 1 or 2 arguments, but got %d", n_args);
+        return;
+    }
+
+    buffer = yed_get_buffer(args[0]);
+    if (buffer == NULL) {
+        yed_cerr("unknown buffer '%s'", args[0]);
+        return;
+    }
+
+    if (auto t = term_for_buffer(buffer)) {
+        std::lock_guard<std::mutex> lock(t->model_lock);
+
+        if (n_args == 1) {
+            t->stop_recording();
+            yed_cprint("stopped recording %s", buffer->name);
+        } else if (t->start_recording(args[1])) {
+            yed_cprint("recording %s to %s", buffer->name, args[1]);
+        } else {
+            yed_cerr("could not open '%s' for writing", args[1]);
+        }
+    } else {
+        yed_cerr("'%s' is not a terminal buffer", args[0]);
+        return;
+    }
+}
+
+static void term_replay_cmd(int n_args, char **args) {
+    std::vector<Recorded_Read> reads;
+    int                        realtime = 0;
+
+    if (n_args < 1 || n_args > 2) {
+        yed_cerr("expected 1 or 2 arguments, but got %d", n_args);
+        return;
+    }
+
+    if (n_args == 2) {
+        if (strcmp(args[1], "realtime") != 0) {
+            yed_cerr("unknown replay mode '%s'", args[1]);
+            return;
+        }
+        realtime = 1;
+    }
+
+    if (!load_recording(args[0], reads)) {
+        yed_cerr("'%s' is not a terminal recording", args[0]);
+        return;
+    }
+
+    Term *t = state->new_detached_term();
+    if (t == NULL) {
+        yed_cerr("could not create a terminal");
+        return;
+    }
+
+    t->replay(std::move(reads), realtime);
+
+    yed_cprint("replaying %s in %s", args[0], t->buffer->name);
+}
+
+static void term_search_cmd(int n_args, char **args) {
+    yed_frame   *frame = ys->active_frame;
+    std::string  pat;
+    int          found;
+    int          row;
+    int          col;
+
+    if (n_args < 1) {
+        yed_cerr("expected 1 or more arguments, but got %d", n_args);
+        return;
+    }
+
+    if (frame == NULL || frame->buffer == NULL) {
+        yed_cerr("no active frame");
+        return;
+    }
+
+    auto t = term_for_buffer(frame->buffer);
+    if (t == NULL) {
+        yed_cerr("'%s' is not a terminal buffer", frame->buffer->name);
+        return;
+    }
+
+    for (int i = 0; i < n_args; i += 1) {
+        if (i) { pat += ' '; }
+        pat += args[i];
+    }
+
+    /* The frame can only be moved around the buffer with term mode off. */
+    if (t->term_mode) { toggle_term_mode(t); }
+
+    {
+        std::lock_guard<std::mutex> lock(t->model_lock);
+        auto &s = t->screen();
+
+        /* Search rows are model rows, so the buffer's rows have to have caught up with them. The frame fills the text in. */
+        t->catch_up_rows();
+
+        found = s.search(pat, frame->cursor_line, frame->cursor_col, &row, &col);
+        if (!found) {
+            found = s.search(pat, s.base() + s.cold.cap + s.n_rows() + 1, 1, &row, &col);
+            if (found) { yed_cprint("search wrapped around to the bottom"); }
+        }
+    }
+
+    if (!found) {
+        yed_cerr("'%s' not found", pat.c_str());
+        return;
+    }
+
+    yed_set_cursor_within_frame(frame, row, col);
+}
+
 static void toggle_term_mode_cmd(int n_args, char **args) {
     if (ys->active_frame == NULL) {
         yed_cerr("no active frame");
@@ -2664,28 +5980,188 @@ static void term_unbind_cmd(int n_args, char **args) {
     del_binding(n_keys, keys);
 }
 
+static const u32 snapshot_layout[] = {
+    sizeof(Cell), sizeof(yed_attrs), sizeof(yed_glyph), sizeof(CSI), sizeof(Attr_Run), sizeof(Row_Op), sizeof(Term_Stats),
+};
+
+static void save_snapshot(Snapshot &snap) {
+    snap.put(SNAPSHOT_MAGIC);
+    snap.put((u32)SNAPSHOT_VERSION);
+    snap.put(snapshot_layout);
+
+    snap.put(state->term_counter);
+
+    snap.put((u64)state->bindings.size());
+    for (auto &b : state->bindings) {
+        snap.put(b.len);
+        for (int i = 0; i < b.len; i += 1) { snap.put(b.keys[i]); }
+        snap.put(std::string(b.cmd));
+        snap.put(b.n_args);
+        for (int i = 0; i < b.n_args; i += 1) { snap.put(std::string(b.args[i])); }
+    }
+
+    for (auto *frames : { &state->save_scroll_offsets, &state->term_mode_off }) {
+        snap.put((u64)frames->size());
+        for (auto &pair : *frames) {
+            snap.put((u64)(uintptr_t)pair.first);
+            snap.put(pair.second);
+        }
+    }
+
+    snap.put((u64)state->terms.size());
+    for (auto t : state->terms) {
+        std::lock_guard<std::mutex> lock(t->model_lock);
+        t->save(snap);
+    }
+}
+
+/* Returns 0, having picked up nothing, if the snapshot was written by a build that lays it out differently. */
+static int load_snapshot(Snapshot &snap) {
+    u32 magic;
+    u32 version;
+    u32 layout[sizeof(snapshot_layout) / sizeof(u32)];
+    u64 n;
+
+    snap.get(magic);
+    snap.get(version);
+    snap.get(layout);
+
+    if (snap.bad
+    ||  magic != SNAPSHOT_MAGIC
+    ||  version != SNAPSHOT_VERSION
+    ||  memcmp(layout, snapshot_layout, sizeof(layout)) != 0) {
+
+        ELOG("terminals from before the reload can't be picked up (snapshot version %u, expected %u)",
+             version, SNAPSHOT_VERSION);
+        return 0;
+    }
+
+    snap.get(state->term_counter);
+
+    snap.get(n);
+    for (u64 i = 0; i < n && !snap.bad; i += 1) {
+        int                      keys[MAX_SEQ_LEN];
+        int                      n_keys;
+        int                      n_args;
+        std::string              cmd;
+        std::vector<std::string> args;
+        std::vector<char*>       argv;
+
+        snap.get(n_keys);
+        if (n_keys <= 0 || n_keys > MAX_SEQ_LEN) { snap.bad = 1; break; }
+        for (int k = 0; k < n_keys; k += 1) { snap.get(keys[k]); }
+        snap.get(cmd);
+        snap.get(n_args);
+        if (n_args < 0 || (u64)n_args > snap.left()) { snap.bad = 1; break; }
+        args.resize(n_args);
+        for (auto &arg : args) {
+            snap.get(arg);
+            argv.push_back((char*)arg.c_str());
+        }
+
+        if (!snap.bad) { make_binding(n_keys, keys, (char*)cmd.c_str(), n_args, argv.data()); }
+    }
+
+    for (auto *frames : { &state->save_scroll_offsets, &state->term_mode_off }) {
+        snap.get(n);
+        for (u64 i = 0; i < n && !snap.bad; i += 1) {
+            u64 frame;
+            int val;
+
+            snap.get(frame);
+            snap.get(val);
+            (*frames)[(yed_frame*)(uintptr_t)frame] = val;
+        }
+    }
+
+    snap.get(n);
+    for (u64 i = 0; i < n && !snap.bad; i += 1) {
+        Term *t = new Term(snap);
+
+        if (!t->valid) {
+            delete t;
+            break;
+        }
+
+        state->adopt_term(t);
+    }
+
+    if (snap.bad) { ELOG("the terminal snapshot is cut short; some terminals were not picked up"); }
+
+    return 1;
+}
+
+/*
+ * The terminals outlive the plugin as a snapshot. Nothing that runs the code being
+ * unloaded may be left, so the I/O and replay threads are stopped first; children
+ * write to their ptys in the meantime and are read again once the snapshot is loaded.
+ */
 static void unload(yed_plugin *self) {
+    Snapshot snap;
+    char     addr_buff[64];
+    char    *blob;
+    u64      size;
+
     if (term_mode_dd != NULL) {
         yed_kill_direct_draw(term_mode_dd);
         term_mode_dd = NULL;
     }
+
+    state->io.stop();
+    for (auto t : state->terms) { t->stop_replay(); }
+
+    if (state->key_sequences_saved) { restore_normal_keys(); }
+
+    save_snapshot(snap);
+
+    size = snap.bytes.size();
+    blob = (char*)malloc(sizeof(size) + size);
+
+    if (blob != NULL) {
+        memcpy(blob, &size, sizeof(size));
+        memcpy(blob + sizeof(size), snap.bytes.data(), size);
+
+        snprintf(addr_buff, sizeof(addr_buff), "%p", (void*)blob);
+        yed_set_var(SNAPSHOT_VAR_NAME, addr_buff);
+    } else {
+        ELOG("no memory for a %llu byte terminal snapshot; closing the terminals", (unsigned long long)size);
+    }
+
+    for (auto t : state->terms) {
+        if (blob != NULL) { t->hand_over(); }
+        delete t;
+    }
+
+    delete state;
+    state = NULL;
 }
 
 extern "C"
 int yed_plugin_boot(yed_plugin *self) {
-    char *state_addr_str;
-    char  addr_buff[64];
+    char *snap_addr_str;
+    int   restored = 0;
 
     YED_PLUG_VERSION_CHECK();
 
     Self = self;
 
-    if ((state_addr_str = yed_get_var(STATE_ADDR_VAR_NAME))) {
-        sscanf(state_addr_str, "%p", (void**)&state);
-    } else {
-        state = new State;
-        snprintf(addr_buff, sizeof(addr_buff), "%p", (void*)state);
-        yed_set_var(STATE_ADDR_VAR_NAME, addr_buff);
+    state = new State;
+
+    if ((snap_addr_str = yed_get_var(SNAPSHOT_VAR_NAME))) {
+        Snapshot  snap;
+        char     *blob = NULL;
+        u64       size;
+
+        sscanf(snap_addr_str, "%p", (void**)&blob);
+        yed_unset_var(SNAPSHOT_VAR_NAME);
+
+        if (blob != NULL) {
+            memcpy(&size, blob, sizeof(size));
+            snap.bytes.assign(blob + sizeof(size), size);
+            free(blob);
+
+            restored = load_snapshot(snap);
+        }
     }
 
     std::map<void(*)(yed_event*), std::vector<yed_event_kind_t> > event_handlers = {
@@ -2708,8 +6184,12 @@ int yed_plugin_boot(yed_plugin *self) {
         { "terminal-shell",                  get_shell()                   },
         { "terminal-termvar",                get_termvar()                 },
         { "terminal-scrollback",             XSTR(DEFAULT_SCROLLBACK)      },
+        { "terminal-hot-scrollback",         XSTR(DEFAULT_HOT_SCROLLBACK)  },
         { "terminal-max-block-size",         XSTR(DEFAULT_MAX_BLOCK_SIZE)  },
         { "terminal-read-chunk-size",        XSTR(DEFAULT_READ_CHUNK_SIZE) },
+        { "terminal-max-fps",                XSTR(DEFAULT_MAX_FPS)         },
+        { "terminal-high-water-mark",        XSTR(DEFAULT_HIGH_WATER_MARK) },
+        { "terminal-fast-forward",           "OFF"                         },
         { "terminal-auto-term-mode",         "ON"                          },
         { "terminal-show-welcome",           "yes"                         },
         { "terminal-color0",                 "&black"                      },
@@ -2741,6 +6221,11 @@ int yed_plugin_boot(yed_plugin *self) {
         { "term-unbind",        term_unbind_cmd        },
         { "term-mode-off",      term_mode_off_cmd      },
         { "term-mode-on",       term_mode_on_cmd       },
+        { "term-stats",         term_stats_cmd         },
+        { "term-bench",         term_bench_cmd         },
+        { "term-record",        term_record_cmd        },
+        { "term-replay",        term_replay_cmd        },
+        { "term-search",        term_search_cmd        },
         { "toggle-term-mode",   toggle_term_mode_cmd   }};
 
     for (auto &pair : event_handlers) {
@@ -2763,9 +6248,16 @@ int yed_plugin_boot(yed_plugin *self) {
     yed_plugin_add_key_map(self, "terminal");
     update_colors();
 
-    YEXE("term-bind", "ctrl-t", "toggle-term-mode");
+    /* The bindings came back with the snapshot, including any change to this one. */
+    if (!restored) { YEXE("term-bind", "ctrl-t", "toggle-term-mode"); }
 
     yed_plugin_set_unload_fn(self, unload);
 
+    if (ys->active_frame != NULL) {
+        if (auto t = term_for_buffer(ys->active_frame->buffer)) {
+            if (t->term_mode) { set_term_keys(); }
+        }
+    }
+
     return 0;
 }
@@ -0,0 +1,356 @@
+/*
+ * Feeds captures of raw terminal output through terminal.cpp outside of yed,
+ * against the stub API in test/yed/plugin.h.
+ *
+ *     replay dump CAPTURE [PATTERN...]
+ *     replay check CAPTURE GOLDEN [PATTERN...]
+ *     replay bench [-p PASSES] CAPTURE...
+ *
+ * dump prints what the buffer holds once CAPTURE has been fed to an 80x24
+ * terminal, text and attributes, then again after reflowing it to 37x10 and
+ * 120x30, followed by where term-search finds each PATTERN. check does the
+ * same with CAPTURE fed in chunks of 1, 3, 7 and 4096 bytes and all at once,
+ * and fails unless every one of them matches GOLDEN.
+ *
+ * bench reports how fast CAPTURE is interpreted and written to the buffer at a
+ * few chunk sizes, along with how many allocations that took per MB of input.
+ * The write figures include the stub's buffer, which copies far more than yed's.
+ */
+#include "../terminal.cpp"
+
+#include <new>
+
+extern std::vector<yed_attrs> stub_line_attrs;
+
+static std::atomic<unsigned long long> n_allocs(0);
+
+#ifdef __GLIBC__
+/* Counting at malloc() catches yed's own allocations as well as operator new's. */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void  __libc_free(void *ptr);
+
+void *malloc(size_t size) noexcept                { n_allocs += 1; return __libc_malloc(size);      }
+void *calloc(size_t n, size_t size) noexcept      { n_allocs += 1; return __libc_calloc(n, size);   }
+void *realloc(void *ptr, size_t size) noexcept    { n_allocs += 1; return __libc_realloc(ptr, size); }
+void  free(void *ptr) noexcept                    { __libc_free(ptr);                               }
+}
+#else
+void *operator new(size_t size) {
+    void *ptr;
+
+    n_allocs += 1;
+    if ((ptr = malloc(size ? size : 1)) == NULL) { throw std::bad_alloc(); }
+
+    return ptr;
+}
+
+void *operator new[](size_t size)          { return operator new(size); }
+void  operator delete(void *ptr) noexcept   { free(ptr);                 }
+void  operator delete[](void *ptr) noexcept { free(ptr);                 }
+#endif
+
+static const size_t chunk_sizes[] = { 1, 3, 7, 4096, 0 };
+
+static void appendf(std::string &out, const char *fmt, ...) {
+    char    buff[512];
+    va_list va;
+
+    va_start(va, fmt);
+    vsnprintf(buff, sizeof(buff), fmt, va);
+    va_end(va);
+
+    out += buff;
+}
+
+/* Feeds bytes in chunks of chunk (all at once if 0), writing to the buffer after each one like update() would. */
+static void feed(Term *t, const std::string &bytes, size_t chunk) {
+    std::lock_guard<std::mutex> lock(t->model_lock);
+
+    if (chunk == 0) { chunk = bytes.size(); }
+
+    for (size_t off = 0; off < bytes.size(); off += chunk) {
+        t->feed(bytes.data() + off, MIN(chunk, bytes.size() - off));
+        t->write_to_buffer();
+    }
+}
+
+static void resize(Term *t, int width, int height) {
+    std::lock_guard<std::mutex> lock(t->model_lock);
+
+    t->resize(width, height);
+    t->write_to_buffer();
+}
+
+/* What someone would see scrolling through all of it with term mode off. */
+static void dump_buffer(Term *t, std::string &out) {
+    yed_frame frame;
+    yed_event event;
+    int       n_lines;
+
+    t->toggle_term_mode();
+
+    {
+        std::lock_guard<std::mutex> lock(t->model_lock);
+        t->fill(1, yed_buff_n_lines(t->buffer));
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    memset(&event, 0, sizeof(event));
+
+    frame.buffer = t->buffer;
+    event.frame  = &frame;
+
+    appendf(out, "== %dx%d\n", t->width(), t->height());
+
+    n_lines = yed_buff_n_lines(t->buffer);
+    for (int row = 1; row <= n_lines; row += 1) {
+        yed_line    *line = yed_buff_get_line(t->buffer, row);
+        yed_attrs    last = ZERO_ATTR;
+        std::string  runs;
+
+        out += std::to_string(row) + "|";
+        out.append((char*)line->chars.data, line->chars.used);
+        out += "|\n";
+
+        stub_line_attrs.clear();
+        event.row = row;
+        t->apply_attrs(&event);
+
+        /* Columns that were never combined are default too, so trailing defaults don't count. */
+        while (stub_line_attrs.size() && !memcmp(&stub_line_attrs.back(), &last, sizeof(last))) {
+            stub_line_attrs.pop_back();
+        }
+
+        for (size_t col = 0; col < stub_line_attrs.size(); col += 1) {
+            auto &a = stub_line_attrs[col];
+
+            if (memcmp(&a, &last, sizeof(a)) == 0) { continue; }
+
+            appendf(runs, " %zu:%x/%x/%x", col + 1, a.flags, a.fg, a.bg);
+            last = a;
+        }
+
+        if (runs.size()) { out += "  attrs" + runs + "\n"; }
+    }
+
+    appendf(out, "cursor %d %d\n", t->row(), t->col());
+
+    t->toggle_term_mode();
+}
+
+/* Every match of pat from the bottom of the screen up, as term-search steps through them. */
+static void dump_search(Term *t, const std::string &pat, std::string &out) {
+    std::lock_guard<std::mutex> lock(t->model_lock);
+    auto &s = t->screen();
+    int   row;
+    int   col;
+
+    appendf(out, "== search '%s'\n", pat.c_str());
+
+    row = s.base() + s.cold.cap + s.n_rows() + 1;
+    col = 1;
+    for (int i = 0; i < 50 && s.search(pat, row, col, &row, &col); i += 1) {
+        appendf(out, "%d %d\n", row, col);
+    }
+}
+
+static std::string replay(const std::string &bytes, size_t chunk, const std::vector<std::string> &pats) {
+    std::string  out;
+    Term        *t = new Term("*replay");
+
+    /* As on the I/O thread, so DBG() doesn't look terminal-debug-log up for every sequence. */
+    thread_log_queue = &t->log_queue;
+
+    resize(t, 80, 24);
+    feed(t, bytes, chunk);
+    dump_buffer(t, out);
+
+    resize(t, 37, 10);
+    dump_buffer(t, out);
+
+    resize(t, 120, 30);
+    dump_buffer(t, out);
+
+    for (auto &pat : pats) { dump_search(t, pat, out); }
+
+    thread_log_queue = NULL;
+
+    delete t;
+
+    return out;
+}
+
+static int first_difference(const std::string &a, const std::string &b, std::string &a_line, std::string &b_line) {
+    size_t off;
+    int    line;
+
+    for (off = 0, line = 1; off < a.size() && off < b.size() && a[off] == b[off]; off += 1) {
+        if (a[off] == '\n') { line += 1; }
+    }
+
+    off    = a.rfind('\n', off ? off - 1 : 0);
+    off    = off == std::string::npos || line == 1 ? 0 : off + 1;
+    a_line = a.substr(off, a.find('\n', off) - off);
+    b_line = b.substr(off, b.find('\n', off) - off);
+
+    return line;
+}
+
+static int check(const char *capture, const char *golden, const std::vector<std::string> &pats) {
+    std::string bytes;
+    std::string expected;
+    std::string got;
+    std::string got_line;
+    std::string expected_line;
+    int         status = 0;
+
+    if (!read_file(capture, bytes))   { fprintf(stderr, "could not read '%s'\n", capture); return 1; }
+    if (!read_file(golden, expected)) { fprintf(stderr, "could not read '%s'\n", golden);  return 1; }
+
+    for (size_t chunk : chunk_sizes) {
+        got = replay(bytes, chunk, pats);
+        if (got == expected) { continue; }
+
+        int line = first_difference(got, expected, got_line, expected_line);
+
+        printf("FAIL %s in chunks of %zu: line %d of %s differs\n", capture, chunk ? chunk : bytes.size(), line, golden);
+        printf("  got:      %s\n", got_line.c_str());
+        printf("  expected: %s\n", expected_line.c_str());
+
+        status = 1;
+    }
+
+    if (status == 0) { printf("ok   %s\n", capture); }
+
+    return status;
+}
+
+static int bench(int passes, char **captures, int n_captures) {
+    std::string bytes;
+
+    for (int i = 0; i < n_captures; i += 1) {
+        if (!read_file(captures[i], bytes)) {
+            fprintf(stderr, "could not read '%s'\n", captures[i]);
+            return 1;
+        }
+
+        for (size_t chunk : { (size_t)64, (size_t)4096, (size_t)0 }) {
+            Term               *t            = new Term("*replay");
+            u64                 parse_ns     = 0;
+            u64                 flush_ns     = 0;
+            unsigned long long  parse_allocs = 0;
+            unsigned long long  flush_allocs = 0;
+            unsigned long long  allocs;
+            u64                 start;
+            double              mb;
+
+            thread_log_queue = &t->log_queue;
+
+            resize(t, 80, 24);
+
+            if (chunk == 0) { chunk = bytes.size(); }
+
+            {
+                std::lock_guard<std::mutex> lock(t->model_lock);
+
+                for (int pass = 0; pass < passes; pass += 1) {
+                    for (size_t off = 0; off < bytes.size(); off += chunk) {
+                        allocs = n_allocs;
+                        start  = measure_time_now_ns();
+                        t->feed(bytes.data() + off, MIN(chunk, bytes.size() - off));
+                        parse_ns     += measure_time_now_ns() - start;
+                        parse_allocs += n_allocs - allocs;
+
+                        allocs = n_allocs;
+                        start  = measure_time_now_ns();
+                        t->write_to_buffer();
+                        flush_ns     += measure_time_now_ns() - start;
+                        flush_allocs += n_allocs - allocs;
+                    }
+                }
+            }
+
+            thread_log_queue = NULL;
+
+            delete t;
+
+            mb = (double)bytes.size() * passes / 1e6;
+
+            printf("%-28s %7zu-byte chunks: parse %7.1f MB/s %6.2f ns/byte %8.1f allocs/MB, write %7.1f MB/s %8.1f allocs/MB\n",
+                   captures[i],
+                   chunk,
+                   parse_ns ? mb / (parse_ns / 1e9) : 0.0,
+                   mb ? parse_ns / (mb * 1e6) : 0.0,
+                   mb ? parse_allocs / mb : 0.0,
+                   flush_ns ? mb / (flush_ns / 1e9) : 0.0,
+                   mb ? flush_allocs / mb : 0.0);
+        }
+    }
+
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: replay dump CAPTURE [PATTERN...]\n"
+                    "       replay check CAPTURE GOLDEN [PATTERN...]\n"
+                    "       replay bench [-p PASSES] CAPTURE...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> pats;
+    std::string              bytes;
+    int                      passes = 20;
+
+    if (argc < 3) { usage(); }
+
+    /* Small enough that the dumps stay readable, big enough that rows go cold and fall off. */
+    if (strcmp(argv[1], "bench") != 0) {
+        yed_set_var("terminal-scrollback",     "300");
+        yed_set_var("terminal-hot-scrollback", "50");
+    }
+
+    yed_plugin_boot(NULL);
+
+    if (strcmp(argv[1], "dump") == 0) {
+        if (!read_file(argv[2], bytes)) {
+            fprintf(stderr, "could not read '%s'\n", argv[2]);
+            return 1;
+        }
+
+        pats.assign(argv + 3, argv + argc);
+        fputs(replay(bytes, 0, pats).c_str(), stdout);
+
+        return 0;
+    }
+
+    if (strcmp(argv[1], "check") == 0) {
+        if (argc < 4) { usage(); }
+
+        pats.assign(argv + 4, argv + argc);
+
+        return check(argv[2], argv[3], pats);
+    }
+
+    if (strcmp(argv[1], "bench") == 0) {
+        argv += 2;
+        argc -= 2;
+
+        if (argc >= 2 && strcmp(argv[0], "-p") == 0) {
+            passes = MAX(s_to_i(argv[1]), 1);
+            argv  += 2;
+            argc  -= 2;
+        }
+
+        if (argc < 1) { usage(); }
+
+        return bench(passes, argv, argc);
+    }
+
+    usage();
+
+    return 2;
+}
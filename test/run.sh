@@ -0,0 +1,31 @@
+#!/usr/bin/env bash
+# Replays every capture and compares the buffer with its golden dump.
+# With "update", rewrites the golden dumps from what the current code does instead.
+cd "$(dirname "$0")"
+
+# capture  search patterns...
+CHECKS=(
+    "cat     snap.get(  line.  this->cold"
+    "gcc     error:  std::"
+    "misc    EEEE  abc"
+    "scroll  47  9"
+    "sgr     light  error"
+    "top     sleep  Tasks:"
+    "utf8    größeren  Ξεσκεπάζω  ──┼──"
+    "vim     Term(  row_ops  sample.cpp"
+)
+
+status=0
+
+for check in "${CHECKS[@]}"; do
+    read -r name pats <<< "${check}"
+
+    if [[ "$1" == "update" ]]; then
+        ./replay dump captures/${name}.cap ${pats} > golden/${name}.txt || status=1
+        echo "wrote golden/${name}.txt"
+    else
+        ./replay check captures/${name}.cap golden/${name}.txt ${pats} || status=1
+    fi
+done
+
+exit ${status}
@@ -0,0 +1,419 @@
+/*
+ * A stand-in for the parts of yed that terminal.cpp calls. Buffers are vectors
+ * of lines, variables are a map, and everything to do with drawing or keys is
+ * a no-op. Columns combined by yed_eline_combine_col_attrs() are kept in
+ * stub_line_attrs so that the replay driver can dump them.
+ */
+extern "C" {
+#include <yed/plugin.h>
+}
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdarg.h>
+#include <sys/time.h>
+
+struct Stub_Buffer {
+    std::vector<yed_line> lines;
+};
+
+static yed_state                           stub_state;
+static std::map<std::string, std::string>  stub_vars;
+static std::map<std::string, yed_buffer*>  stub_buffers;
+
+yed_state              *ys = &stub_state;
+std::vector<yed_attrs>  stub_line_attrs;
+int                     stub_verbose;
+
+#define LINES(b) (((Stub_Buffer*)(b)->impl)->lines)
+
+static void check_row(yed_buffer *buffer, int row, int n_extra, const char *fn) {
+    if (buffer->flags & BUFF_RD_ONLY) {
+        fprintf(stderr, "%s: '%s' is read-only\n", fn, buffer->name);
+        abort();
+    }
+    if (row < 1 || row > (int)LINES(buffer).size() + n_extra) {
+        fprintf(stderr, "%s: row %d out of range in '%s' (%d lines)\n", fn, row, buffer->name, (int)LINES(buffer).size());
+        abort();
+    }
+}
+
+array_t _array_make(int elem_size) {
+    array_t a;
+
+    a.data      = NULL;
+    a.elem_size = elem_size;
+    a.used      = 0;
+    a.capacity  = 0;
+
+    return a;
+}
+
+void array_free(array_t a) { free(a.data); }
+
+void *_array_push(array_t *a, void *elem) {
+    if (a->used == a->capacity) {
+        a->capacity = a->capacity ? a->capacity * 2 : 16;
+        a->data     = realloc(a->data, a->capacity * a->elem_size);
+    }
+
+    memcpy((char*)a->data + a->used * a->elem_size, elem, a->elem_size);
+    a->used += 1;
+
+    return (char*)a->data + (a->used - 1) * a->elem_size;
+}
+
+int yed_get_glyph_len(yed_glyph *g) {
+    unsigned char c = g->u_c;
+
+    if ((c & 0x80) == 0x00) { return 1; }
+    if ((c & 0xE0) == 0xC0) { return 2; }
+    if ((c & 0xF0) == 0xE0) { return 3; }
+    if ((c & 0xF8) == 0xF0) { return 4; }
+
+    return 1;
+}
+
+/* East Asian wide and emoji ranges only, so that dumps don't depend on the libc's tables. */
+int yed_get_glyph_width(yed_glyph *g) {
+    static const u32 wide[][2] = {
+        { 0x1100,  0x115F  }, { 0x2E80,  0xA4CF  }, { 0xAC00,  0xD7A3  },
+        { 0xF900,  0xFAFF  }, { 0xFE30,  0xFE4F  }, { 0xFF00,  0xFF60  },
+        { 0xFFE0,  0xFFE6  }, { 0x1F300, 0x1F64F }, { 0x1F900, 0x1F9FF },
+        { 0x20000, 0x3FFFD },
+    };
+    const unsigned char *b = (const unsigned char*)g->bytes;
+    u32                  cp;
+
+    switch (yed_get_glyph_len(g)) {
+        case 2:  cp = ((b[0] & 0x1F) << 6)  | (b[1] & 0x3F);                                             break;
+        case 3:  cp = ((b[0] & 0x0F) << 12) | ((b[1] & 0x3F) << 6)  | (b[2] & 0x3F);                     break;
+        case 4:  cp = ((b[0] & 0x07) << 18) | ((b[1] & 0x3F) << 12) | ((b[2] & 0x3F) << 6) | (b[3] & 0x3F); break;
+        default: return b[0] == '\t' ? yed_get_tab_width() : 1;
+    }
+
+    for (auto &r : wide) {
+        if (cp >= r[0] && cp <= r[1]) { return 2; }
+    }
+
+    return 1;
+}
+
+yed_glyph yed_glyph_copy(yed_glyph *g) {
+    yed_glyph copy;
+
+    copy.data = 0;
+    if (g->c) { memcpy(copy.bytes, g->bytes, yed_get_glyph_len(g)); }
+
+    return copy;
+}
+
+yed_line yed_new_line_with_cap(int len) {
+    yed_line line;
+
+    (void)len;
+
+    line.chars        = array_make(char);
+    line.visual_width = 0;
+    line.n_glyphs     = 0;
+
+    return line;
+}
+
+void yed_free_line(yed_line *line) { array_free(line->chars); }
+
+void yed_clear_line(yed_line *line) {
+    line->chars.used   = 0;
+    line->visual_width = 0;
+    line->n_glyphs     = 0;
+}
+
+void yed_line_append_glyph(yed_line *line, yed_glyph *g) {
+    int len = yed_get_glyph_len(g);
+
+    for (int i = 0; i < len; i += 1) { array_push(line->chars, g->bytes[i]); }
+
+    line->visual_width += yed_get_glyph_width(g);
+    line->n_glyphs     += 1;
+}
+
+static void set_line_text(yed_line *line, const std::string &text) {
+    yed_clear_line(line);
+    for (size_t off = 0; off < text.size(); off += yed_get_glyph_len(GLYPH(&text[off]))) {
+        yed_line_append_glyph(line, GLYPH(&text[off]));
+    }
+}
+
+/* Byte offset of the glyph at col, or of the end of the line. */
+static size_t col_to_offset(const std::string &text, int col) {
+    size_t off = 0;
+
+    for (int c = 1; off < text.size() && c < col; off += yed_get_glyph_len(GLYPH(&text[off]))) {
+        c += yed_get_glyph_width(GLYPH(&text[off]));
+    }
+
+    return off;
+}
+
+yed_glyph *yed_line_col_to_glyph(yed_line *line, int col) {
+    char *p   = (char*)line->chars.data;
+    char *end = p + line->chars.used;
+
+    for (int c = 1; p < end; p += yed_get_glyph_len(GLYPH(p))) {
+        c += yed_get_glyph_width(GLYPH(p));
+        if (col < c) { return GLYPH(p); }
+    }
+
+    return NULL;
+}
+
+void yed_execute_command(const char *name, int n_args, char **args) { }
+
+void yed_log(const char *fmt, ...) {
+    va_list va;
+
+    if (!stub_verbose) { return; }
+
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+    fprintf(stderr, "\n");
+}
+
+void yed_cerr(const char *fmt, ...) {
+    va_list va;
+
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+    fprintf(stderr, "\n");
+}
+
+void yed_cprint(const char *fmt, ...) {
+    va_list va;
+
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+    fprintf(stderr, "\n");
+}
+
+char *yed_get_var(const char *name) {
+    auto it = stub_vars.find(name);
+    return it == stub_vars.end() ? NULL : (char*)it->second.c_str();
+}
+
+void yed_set_var(const char *name, const char *val) { stub_vars[name] = val; }
+void yed_unset_var(const char *name)                { stub_vars.erase(name);  }
+
+int yed_var_is_truthy(const char *name) {
+    const char *val = yed_get_var(name);
+
+    if (val == NULL) { return 0; }
+
+    return strcasecmp(val, "off") && strcasecmp(val, "no") && strcasecmp(val, "false") && strcmp(val, "0");
+}
+
+int yed_get_var_as_int(const char *name, int *out) {
+    const char *val = yed_get_var(name);
+    char       *end;
+    long        l;
+
+    if (val == NULL) { return 0; }
+
+    l = strtol(val, &end, 10);
+    if (end == val) { return 0; }
+
+    *out = (int)l;
+    return 1;
+}
+
+yed_buffer *yed_get_buffer(const char *name) {
+    auto it = stub_buffers.find(name);
+    return it == stub_buffers.end() ? NULL : it->second;
+}
+
+yed_buffer *yed_get_or_create_special_rdonly_buffer(const char *name) {
+    yed_buffer  *buffer;
+    Stub_Buffer *impl;
+
+    if ((buffer = yed_get_buffer(name))) { return buffer; }
+
+    impl = new Stub_Buffer;
+    impl->lines.push_back(yed_new_line_with_cap(0));
+
+    buffer                = new yed_buffer();
+    buffer->flags         = BUFF_RD_ONLY;
+    buffer->name          = strdup(name);
+    buffer->impl          = impl;
+    stub_buffers[name]    = buffer;
+
+    return buffer;
+}
+
+yed_buffer *yed_get_yank_buffer(void) { return yed_get_or_create_special_rdonly_buffer("*yank"); }
+
+void yed_free_buffer(yed_buffer *buffer) {
+    stub_buffers.erase(buffer->name);
+
+    for (auto &line : LINES(buffer)) { yed_free_line(&line); }
+
+    delete (Stub_Buffer*)buffer->impl;
+    free(buffer->name);
+    delete buffer;
+}
+
+int yed_buff_n_lines(yed_buffer *buffer) { return LINES(buffer).size(); }
+
+yed_line *yed_buff_get_line(yed_buffer *buffer, int row) {
+    if (row < 1 || row > (int)LINES(buffer).size()) { return NULL; }
+    return &LINES(buffer)[row - 1];
+}
+
+void yed_buff_delete_line_no_undo(yed_buffer *buffer, int row) {
+    check_row(buffer, row, 0, __func__);
+
+    yed_free_line(&LINES(buffer)[row - 1]);
+    LINES(buffer).erase(LINES(buffer).begin() + row - 1);
+
+    if (LINES(buffer).empty()) { LINES(buffer).push_back(yed_new_line_with_cap(0)); }
+}
+
+int yed_buff_insert_line_no_undo(yed_buffer *buffer, int row) {
+    check_row(buffer, row, 1, __func__);
+    LINES(buffer).insert(LINES(buffer).begin() + row - 1, yed_new_line_with_cap(0));
+    return row;
+}
+
+int yed_buffer_add_line_no_undo(yed_buffer *buffer) {
+    check_row(buffer, 1, 0, __func__);
+    LINES(buffer).push_back(yed_new_line_with_cap(0));
+    return LINES(buffer).size();
+}
+
+void yed_buff_set_line_no_undo(yed_buffer *buffer, int row, yed_line *line) {
+    check_row(buffer, row, 0, __func__);
+    set_line_text(&LINES(buffer)[row - 1], std::string((char*)line->chars.data, line->chars.used));
+}
+
+void yed_buff_clear_no_undo(yed_buffer *buffer) {
+    check_row(buffer, 1, 0, __func__);
+
+    for (auto &line : LINES(buffer)) { yed_free_line(&line); }
+
+    LINES(buffer).clear();
+    LINES(buffer).push_back(yed_new_line_with_cap(0));
+}
+
+void yed_line_clear_no_undo(yed_buffer *buffer, int row) {
+    check_row(buffer, row, 0, __func__);
+    yed_clear_line(&LINES(buffer)[row - 1]);
+}
+
+void yed_append_to_line_no_undo(yed_buffer *buffer, int row, yed_glyph g) {
+    check_row(buffer, row, 0, __func__);
+    yed_line_append_glyph(&LINES(buffer)[row - 1], &g);
+}
+
+void yed_insert_into_line_no_undo(yed_buffer *buffer, int row, int col, yed_glyph g) {
+    yed_line    *line;
+    std::string  text;
+
+    check_row(buffer, row, 0, __func__);
+
+    line = &LINES(buffer)[row - 1];
+    text.assign((char*)line->chars.data, line->chars.used);
+    text.insert(col_to_offset(text, col), g.bytes, yed_get_glyph_len(&g));
+
+    set_line_text(line, text);
+}
+
+void yed_delete_from_line_no_undo(yed_buffer *buffer, int row, int col) {
+    yed_line    *line;
+    std::string  text;
+    size_t       off;
+
+    check_row(buffer, row, 0, __func__);
+
+    line = &LINES(buffer)[row - 1];
+    text.assign((char*)line->chars.data, line->chars.used);
+
+    off = col_to_offset(text, col);
+    if (off < text.size()) { text.erase(off, yed_get_glyph_len(GLYPH(&text[off]))); }
+
+    set_line_text(line, text);
+}
+
+char *yed_get_buffer_text(yed_buffer *buffer) {
+    std::string text;
+
+    for (auto &line : LINES(buffer)) {
+        text.append((char*)line.chars.data, line.chars.used);
+        text += '\n';
+    }
+
+    return strdup(text.c_str());
+}
+
+void yed_force_update(void) { }
+int  yed_get_tab_width(void) { return 8; }
+
+/* Any stable, distinct value will do for the palette. */
+yed_attrs yed_parse_attrs(const char *string) {
+    yed_attrs attrs = ZERO_ATTR;
+    u32       hash  = 2166136261u;
+
+    for (; *string; string += 1) { hash = (hash ^ (unsigned char)*string) * 16777619u; }
+
+    ATTR_SET_FG_KIND(attrs.flags, ATTR_KIND_RGB);
+    attrs.fg = hash & 0xFFFFFF;
+
+    return attrs;
+}
+
+void yed_eline_combine_col_attrs(yed_event *event, int col, yed_attrs *attrs) {
+    if ((int)stub_line_attrs.size() < col) { stub_line_attrs.resize(col, ZERO_ATTR); }
+    stub_line_attrs[col - 1] = *attrs;
+}
+
+void yed_set_cursor_within_frame(yed_frame *frame, int row, int col) {
+    frame->cursor_line = row;
+    frame->cursor_col  = col;
+}
+
+void yed_set_cursor_far_within_frame(yed_frame *frame, int row, int col) { yed_set_cursor_within_frame(frame, row, col); }
+
+yed_direct_draw_t *yed_direct_draw(int row, int col, yed_attrs attrs, const char *string) { return NULL; }
+void               yed_kill_direct_draw(yed_direct_draw_t *dd)                          { }
+
+int   yed_string_to_keys(const char *string, int *keys) { return -1;          }
+char *yed_keys_to_string(int n, int *keys)              { return strdup(""); }
+
+int yed_get_real_keys(int key, int *len, int *keys) {
+    *len    = 1;
+    keys[0] = key;
+    return 1;
+}
+
+void yed_enable_key_map(const char *map)  { }
+void yed_disable_key_map(const char *map) { }
+void yed_unbind_key(int key)              { }
+void yed_delete_key_sequence(int key)     { }
+
+int  yed_plugin_add_key_sequence(yed_plugin *plug, int len, int *keys)                                         { return 0x10000; }
+void yed_plugin_map_bind_key(yed_plugin *plug, const char *map, int key, char *cmd, int n_args, char **args) { }
+void yed_plugin_add_event_handler(yed_plugin *plug, yed_event_handler handler)                                 { }
+void yed_plugin_set_command(yed_plugin *plug, const char *name, void (*fn)(int, char**))                      { }
+void yed_plugin_add_key_map(yed_plugin *plug, const char *map)                                                 { }
+void yed_plugin_set_unload_fn(yed_plugin *plug, void (*fn)(yed_plugin*))                                       { }
+
+int s_to_i(const char *s) { return atoi(s); }
+
+u64 measure_time_now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000ull + tv.tv_usec / 1000;
+}
@@ -0,0 +1,296 @@
+/*
+ * Just enough of yed's plugin API for test/replay.cpp to build terminal.cpp
+ * without yed. The declarations follow yed's; test/stub.cpp implements them.
+ */
+#ifndef __YED_PLUGIN_STUB_H__
+#define __YED_PLUGIN_STUB_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t  i32;
+typedef int64_t  i64;
+
+typedef struct {
+    void *data;
+    int   elem_size;
+    int   used;
+    int   capacity;
+} array_t;
+
+array_t  _array_make(int elem_size);
+void     array_free(array_t a);
+void    *_array_push(array_t *a, void *elem);
+
+#define array_make(T)         _array_make(sizeof(T))
+#define array_len(a)          ((a).used)
+#define array_data(a)         ((a).data)
+#define array_push(a, e)      _array_push(&(a), (void*)&(e))
+#define array_traverse(a, it) \
+    for ((it) = (decltype(it))(a).data; (char*)(it) < (char*)(a).data + (a).used * (a).elem_size; (it)++)
+
+typedef union {
+    char          c;
+    unsigned char u_c;
+    char          bytes[4];
+    u32           data;
+} yed_glyph;
+
+typedef struct {
+    u32 flags;
+    u32 fg;
+    u32 bg;
+} yed_attrs;
+
+#define ZERO_ATTR              ((yed_attrs){ 0, 0, 0 })
+#define ATTR_NORMAL            (0x0)
+#define ATTR_INVERSE           (0x1)
+#define ATTR_BOLD              (0x2)
+#define ATTR_UNDERLINE         (0x4)
+#define ATTR_16_LIGHT_FG       (0x80)
+#define ATTR_16_LIGHT_BG       (0x100)
+#define ATTR_KIND_NONE         (0)
+#define ATTR_KIND_16           (1)
+#define ATTR_KIND_256          (2)
+#define ATTR_KIND_RGB          (3)
+#define ATTR_FG_KIND(f)        (((f) >> 9) & 3)
+#define ATTR_BG_KIND(f)        (((f) >> 11) & 3)
+#define ATTR_SET_FG_KIND(f, k) ((f) = ((f) & ~(3u << 9)) | ((k) << 9))
+#define ATTR_SET_BG_KIND(f, k) ((f) = ((f) & ~(3u << 11)) | ((k) << 11))
+#define RGB_32(r, g, b)        (((r) << 16) | ((g) << 8) | (b))
+
+#define GLYPH(x) ((yed_glyph*)(void*)(x))
+
+int       yed_get_glyph_len(yed_glyph *g);
+int       yed_get_glyph_width(yed_glyph *g);
+yed_glyph yed_glyph_copy(yed_glyph *g);
+
+#define yed_glyph_traverse_n(_s, _n, _g) \
+    for ((_g) = GLYPH(_s); (char*)(_g) < ((char*)(_s)) + (_n); (_g) = GLYPH(((char*)(_g)) + yed_get_glyph_len(_g)))
+
+typedef struct {
+    array_t chars;
+    int     visual_width;
+    int     n_glyphs;
+} yed_line;
+
+yed_line   yed_new_line_with_cap(int len);
+void       yed_free_line(yed_line *line);
+void       yed_clear_line(yed_line *line);
+void       yed_line_append_glyph(yed_line *line, yed_glyph *g);
+yed_glyph *yed_line_col_to_glyph(yed_line *line, int col);
+
+#define BUFF_RD_ONLY    (0x4)
+#define BUFF_YANK_LINES (0x8)
+
+#define RANGE_NORMAL (0x1)
+#define RANGE_LINE   (0x2)
+#define RANGE_RECT   (0x3)
+
+typedef struct {
+    int kind;
+    int anchor_row;
+    int anchor_col;
+    int cursor_row;
+    int cursor_col;
+    int locked;
+} yed_range;
+
+typedef struct yed_buffer_t {
+    int        flags;
+    int        has_selection;
+    yed_range  selection;
+    char      *name;
+    void      *impl;
+} yed_buffer;
+
+typedef struct yed_frame_t {
+    yed_buffer *buffer;
+    int         top;
+    int         left;
+    int         width;
+    int         height;
+    int         scroll_off;
+    int         buffer_y_offset;
+    int         cursor_line;
+    int         cursor_col;
+} yed_frame;
+
+#define MAX_SEQ_LEN (8)
+
+typedef struct {
+    int len;
+    int seq[MAX_SEQ_LEN];
+    int key;
+} yed_key_sequence;
+
+typedef struct {
+    yed_frame *active_frame;
+    array_t    frames;
+    int        interactive_command;
+    array_t    key_sequences;
+    int        tabw;
+} yed_state;
+
+extern yed_state *ys;
+
+typedef enum {
+    EVENT_PRE_DRAW_EVERYTHING,
+    EVENT_POST_DRAW_EVERYTHING,
+    EVENT_KEY_PRESSED,
+    EVENT_CMD_PRE_RUN,
+    EVENT_LINE_PRE_DRAW,
+    EVENT_ROW_PRE_CLEAR,
+    EVENT_FRAME_POST_RESIZE,
+    EVENT_TERMINAL_RESIZED,
+    EVENT_FRAME_POST_DELETE,
+    EVENT_FRAME_PRE_SET_BUFFER,
+    EVENT_FRAME_POST_SET_BUFFER,
+    EVENT_SIGNAL_RECEIVED,
+    EVENT_FRAME_ACTIVATED,
+    EVENT_FRAME_PRE_ACTIVATE,
+    EVENT_VAR_POST_SET,
+    EVENT_STYLE_CHANGE,
+    EVENT_BUFFER_PRE_SEARCH,
+    EVENT_PLUGIN_PRE_UNLOAD,
+} yed_event_kind_t;
+
+typedef struct {
+    yed_event_kind_t  kind;
+    yed_frame        *frame;
+    yed_buffer       *buffer;
+    int               row;
+    int               key;
+    int               cancel;
+    const char       *cmd_name;
+    char            **args;
+    int               n_args;
+    yed_attrs         row_base_attr;
+    int               signum;
+    const char       *var_name;
+    const char       *var_val;
+} yed_event;
+
+typedef struct {
+    yed_event_kind_t kind;
+    void (*fn)(yed_event*);
+} yed_event_handler;
+
+typedef struct yed_plugin_t      yed_plugin;
+typedef struct yed_direct_draw_t yed_direct_draw_t;
+
+enum {
+    KEY_NULL    = 0,
+    CTRL_G      = 7,
+    CTRL_H      = 8,
+    TAB         = 9,
+    ENTER       = 13,
+    CTRL_O      = 15,
+    ESC         = 27,
+    ARROW_LEFT  = 1000,
+    ARROW_RIGHT,
+    ARROW_UP,
+    ARROW_DOWN,
+    DEL_KEY,
+    HOME_KEY,
+    END_KEY,
+    PAGE_UP,
+    PAGE_DOWN,
+    SHIFT_TAB,
+    FN1, FN2, FN3, FN4, FN5, FN6, FN7, FN8, FN9, FN10, FN11, FN12,
+    MENU_KEY,
+};
+
+#define IS_MOUSE(k)     (((k) >> 24) == 0x2)
+#define MOUSE_BUTTON(k) (((k) >> 16) & 0xff)
+
+enum {
+    MOUSE_WHEEL_UP   = 64,
+    MOUSE_WHEEL_DOWN = 65,
+};
+
+#define TERM_CYAN  "\e[36m"
+#define TERM_RESET "\e[0m"
+
+#define XSTR(x)            STR(x)
+#define STR(x)             #x
+#define MAX(a, b)          ((a) > (b) ? (a) : (b))
+#define MIN(a, b)          ((a) < (b) ? (a) : (b))
+#define LIMIT(x, lo, hi)   do { if ((x) < (lo)) { (x) = (lo); } if ((x) > (hi)) { (x) = (hi); } } while (0)
+#define ASSERT(cond, msg)  do { if (!(cond)) { fprintf(stderr, "assertion failed: %s\n", (msg)); abort(); } } while (0)
+#define is_digit(c)        ((c) >= '0' && (c) <= '9')
+
+#define LOG_FN_ENTER()           do { } while (0)
+#define LOG_CMD_ENTER(name)      do { } while (0)
+#define LOG_EXIT()               do { } while (0)
+#define YED_PLUG_VERSION_CHECK() do { } while (0)
+
+#define YEXE(cmd, ...)                                                             \
+    do {                                                                           \
+        const char *_args[] = { __VA_ARGS__ };                                     \
+        yed_execute_command((cmd), sizeof(_args) / sizeof(_args[0]), (char**)_args); \
+    } while (0)
+
+int  s_to_i(const char *s);
+u64  measure_time_now_ms(void);
+
+void  yed_execute_command(const char *name, int n_args, char **args);
+void  yed_log(const char *fmt, ...);
+void  yed_cerr(const char *fmt, ...);
+void  yed_cprint(const char *fmt, ...);
+
+char *yed_get_var(const char *name);
+void  yed_set_var(const char *name, const char *val);
+void  yed_unset_var(const char *name);
+int   yed_var_is_truthy(const char *name);
+int   yed_get_var_as_int(const char *name, int *out);
+
+yed_buffer *yed_get_buffer(const char *name);
+yed_buffer *yed_get_or_create_special_rdonly_buffer(const char *name);
+yed_buffer *yed_get_yank_buffer(void);
+void        yed_free_buffer(yed_buffer *buffer);
+int         yed_buff_n_lines(yed_buffer *buffer);
+yed_line   *yed_buff_get_line(yed_buffer *buffer, int row);
+void        yed_buff_delete_line_no_undo(yed_buffer *buffer, int row);
+int         yed_buff_insert_line_no_undo(yed_buffer *buffer, int row);
+int         yed_buffer_add_line_no_undo(yed_buffer *buffer);
+void        yed_buff_set_line_no_undo(yed_buffer *buffer, int row, yed_line *line);
+void        yed_buff_clear_no_undo(yed_buffer *buffer);
+void        yed_line_clear_no_undo(yed_buffer *buffer, int row);
+void        yed_append_to_line_no_undo(yed_buffer *buffer, int row, yed_glyph g);
+void        yed_insert_into_line_no_undo(yed_buffer *buffer, int row, int col, yed_glyph g);
+void        yed_delete_from_line_no_undo(yed_buffer *buffer, int row, int col);
+char       *yed_get_buffer_text(yed_buffer *buffer);
+
+void       yed_force_update(void);
+int        yed_get_tab_width(void);
+yed_attrs  yed_parse_attrs(const char *string);
+void       yed_eline_combine_col_attrs(yed_event *event, int col, yed_attrs *attrs);
+void       yed_set_cursor_within_frame(yed_frame *frame, int row, int col);
+void       yed_set_cursor_far_within_frame(yed_frame *frame, int row, int col);
+
+yed_direct_draw_t *yed_direct_draw(int row, int col, yed_attrs attrs, const char *string);
+void               yed_kill_direct_draw(yed_direct_draw_t *dd);
+
+int   yed_string_to_keys(const char *string, int *keys);
+char *yed_keys_to_string(int n, int *keys);
+int   yed_get_real_keys(int key, int *len, int *keys);
+void  yed_enable_key_map(const char *map);
+void  yed_disable_key_map(const char *map);
+void  yed_unbind_key(int key);
+void  yed_delete_key_sequence(int key);
+
+int   yed_plugin_add_key_sequence(yed_plugin *plug, int len, int *keys);
+void  yed_plugin_map_bind_key(yed_plugin *plug, const char *map, int key, char *cmd, int n_args, char **args);
+void  yed_plugin_add_event_handler(yed_plugin *plug, yed_event_handler handler);
+void  yed_plugin_set_command(yed_plugin *plug, const char *name, void (*fn)(int, char**));
+void  yed_plugin_add_key_map(yed_plugin *plug, const char *map);
+void  yed_plugin_set_unload_fn(yed_plugin *plug, void (*fn)(yed_plugin*));
+
+#endif